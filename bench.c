@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+
+#include "litechr_ioctl.h"
+
+// Benchmark of the driver through the device file.
+// Every case runs a fixed number of operations and reports their rate, throughput and latency percentiles,
+// as a table on stdout and optionally as JSON (see usage()).
+
+#define RETURN_ON_ERROR(expr)           {int res; res = expr; if (res < 0) return res;}
+
+#define DEVICE_NAME                 "/dev/litechr"
+#define DEFAULT_ITERATIONS          20000
+#define DEFAULT_MAX_THREADS         4
+// Size of a single write or read of the thread cases
+#define THREADS_CHUNK_SIZE          64
+// Time a consumer waits in poll before checking whether all data was consumed
+#define CONSUMER_POLL_TIMEOUT_MS    10
+#define MAX_RESULTS                 256
+
+// Open mode of the benchmarked files
+enum bench_mode {
+    BENCH_SHARED,
+    BENCH_EXCLUSIVE,
+    BENCH_MULTI,
+    BENCH_MODES,
+};
+
+static const char *bench_mode_names[BENCH_MODES] = {"shared", "exclusive", "multi"};
+static const int bench_mode_flags[BENCH_MODES] = {0, O_EXCL, O_CREAT};
+
+// Result of a single benchmark case
+struct bench_result {
+    char name[32];
+    enum bench_mode mode;
+    // Bytes per operation (0 for open/close)
+    size_t size;
+    int producers;
+    int consumers;
+    // Number of measured operations and bytes moved by them
+    uint64_t ops;
+    uint64_t bytes;
+    double seconds;
+    // Latency percentiles of a single operation in nanoseconds
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+// Latencies measured by a thread
+struct bench_samples {
+    uint64_t *ns;
+    size_t count;
+};
+
+// State shared by the threads of a producer/consumer case
+struct bench_threads {
+    enum bench_mode mode;
+    // Multi mode threads use this file, other modes open a file per thread
+    int fd;
+    size_t iterations;
+    // Total number of bytes written by all producers and read so far by all consumers
+    uint64_t total;
+    atomic_uint_fast64_t consumed;
+    // Set by a failed thread, so that the others do not wait for it forever
+    atomic_int failed;
+    pthread_barrier_t start;
+};
+
+// Per thread argument of a producer/consumer case
+struct bench_thread {
+    struct bench_threads *pshared;
+    struct bench_samples samples;
+    int ret;
+};
+
+static struct bench_result results[MAX_RESULTS];
+static int results_count;
+static size_t iterations = DEFAULT_ITERATIONS;
+static int max_threads = DEFAULT_MAX_THREADS;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *pa, const void *pb)
+{
+    uint64_t a = *(const uint64_t *)pa, b = *(const uint64_t *)pb;
+
+    return a < b ? -1 : a > b;
+}
+
+// Get the latency at the given fraction of the sorted samples
+static uint64_t percentile(const struct bench_samples *psamples, double fraction)
+{
+    size_t i;
+
+    if (psamples->count == 0)
+        return 0;
+    i = (size_t)(fraction * (psamples->count - 1) + 0.5);
+    return psamples->ns[i];
+}
+
+static int samples_alloc(struct bench_samples *psamples, size_t count)
+{
+    psamples->ns = malloc(count * sizeof(*psamples->ns));
+    psamples->count = 0;
+    if (psamples->ns == NULL) {
+        printf("Failed to allocate %zu samples\n", count);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Add a result, computing the percentiles of the samples (which get sorted)
+static void result_add(const char *name, enum bench_mode mode, size_t size, int producers, int consumers,
+    uint64_t ops, uint64_t bytes, uint64_t elapsed_ns, struct bench_samples *psamples)
+{
+    struct bench_result *presult;
+
+    if (results_count == MAX_RESULTS)
+        return;
+    presult = &results[results_count++];
+    qsort(psamples->ns, psamples->count, sizeof(*psamples->ns), compare_u64);
+    snprintf(presult->name, sizeof presult->name, "%s", name);
+    presult->mode = mode;
+    presult->size = size;
+    presult->producers = producers;
+    presult->consumers = consumers;
+    presult->ops = ops;
+    presult->bytes = bytes;
+    presult->seconds = elapsed_ns / 1e9;
+    presult->p50 = percentile(psamples, 0.5);
+    presult->p99 = percentile(psamples, 0.99);
+    presult->p999 = percentile(psamples, 0.999);
+}
+
+static int open_mode(enum bench_mode mode, int flags)
+{
+    int fd;
+
+    fd = open(DEVICE_NAME, O_RDWR | bench_mode_flags[mode] | flags);
+    if (fd < 0) {
+        printf("Opening %s mode file: error %d\n", bench_mode_names[mode], errno);
+        return -errno;
+    }
+    return fd;
+}
+
+// Drop the data left in the shared context by earlier runs
+static int clear_shared(void)
+{
+    char buf[4096];
+    int fd;
+
+    RETURN_ON_ERROR(fd = open_mode(BENCH_SHARED, O_NONBLOCK));
+    while (read(fd, buf, sizeof buf) > 0)
+        ;
+    close(fd);
+    return 0;
+}
+
+// Single file writing and reading back a buffer of every size from 1 byte up to the queue size
+static int bench_sizes(enum bench_mode mode)
+{
+    struct bench_samples samples;
+    uint64_t start, t;
+    unsigned int queue_size;
+    size_t size, i;
+    char *buf;
+    int fd, ret = 0;
+
+    RETURN_ON_ERROR(fd = open_mode(mode, 0));
+    if (ioctl(fd, LITECHR_IOC_GET_SIZE, &queue_size) < 0) {
+        printf("Getting queue size: error %d\n", errno);
+        close(fd);
+        return -errno;
+    }
+    buf = calloc(1, queue_size);
+    if (buf == NULL || samples_alloc(&samples, iterations) < 0) {
+        free(buf);
+        close(fd);
+        return -ENOMEM;
+    }
+
+    for (size = 1; ; size = size * 4 < queue_size ? size * 4 : queue_size) {
+        samples.count = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            t = now_ns();
+            if (write(fd, buf, size) != (ssize_t)size || read(fd, buf, size) != (ssize_t)size) {
+                printf("Write/read of %zu bytes: error %d\n", size, errno);
+                ret = -EIO;
+                goto out;
+            }
+            samples.ns[samples.count++] = now_ns() - t;
+        }
+        result_add("write_read", mode, size, 1, 1, iterations, (uint64_t)iterations * size, now_ns() - start, &samples);
+        if (size == queue_size)
+            break;
+    }
+
+out:
+    free(samples.ns);
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static void *producer_fn(void *parg)
+{
+    struct bench_thread *pstate = parg;
+    struct bench_threads *pshared = pstate->pshared;
+    char buf[THREADS_CHUNK_SIZE] = {0};
+    struct pollfd pfd;
+    uint64_t t;
+    size_t i;
+    int fd = pshared->fd;
+
+    // Producers do not block in write either, so that they can stop if the consumers fail
+    if (pshared->mode != BENCH_MULTI && (fd = open_mode(pshared->mode, O_NONBLOCK)) < 0) {
+        pstate->ret = fd;
+        atomic_store(&pshared->failed, 1);
+    }
+    pthread_barrier_wait(&pshared->start);
+    if (pstate->ret < 0)
+        return NULL;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    for (i = 0; i < pshared->iterations; i++) {
+        t = now_ns();
+        while (write(fd, buf, sizeof buf) != sizeof buf) {
+            if ((errno != ENOBUFS && errno != EAGAIN) || atomic_load(&pshared->failed)) {
+                if (errno != ENOBUFS && errno != EAGAIN)
+                    printf("Producer write: error %d\n", errno);
+                pstate->ret = -EIO;
+                atomic_store(&pshared->failed, 1);
+                goto out;
+            }
+            poll(&pfd, 1, CONSUMER_POLL_TIMEOUT_MS);
+        }
+        pstate->samples.ns[pstate->samples.count++] = now_ns() - t;
+    }
+
+out:
+
+    if (pshared->mode != BENCH_MULTI)
+        close(fd);
+    return NULL;
+}
+
+static void *consumer_fn(void *parg)
+{
+    struct bench_thread *pstate = parg;
+    struct bench_threads *pshared = pstate->pshared;
+    char buf[THREADS_CHUNK_SIZE];
+    struct pollfd pfd;
+    uint64_t t;
+    ssize_t length;
+    int fd = pshared->fd;
+
+    // Consumers do not block in read, so that they can stop once the producers' data is consumed
+    if (pshared->mode != BENCH_MULTI && (fd = open_mode(pshared->mode, O_NONBLOCK)) < 0) {
+        pstate->ret = fd;
+        atomic_store(&pshared->failed, 1);
+    }
+    pthread_barrier_wait(&pshared->start);
+    if (pstate->ret < 0)
+        return NULL;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (atomic_load(&pshared->consumed) < pshared->total && !atomic_load(&pshared->failed)) {
+        t = now_ns();
+        length = read(fd, buf, sizeof buf);
+        if (length > 0) {
+            if (pstate->samples.count < pshared->iterations * 2)
+                pstate->samples.ns[pstate->samples.count++] = now_ns() - t;
+            atomic_fetch_add(&pshared->consumed, length);
+        }
+        else if (length < 0 && errno != EAGAIN) {
+            printf("Consumer read: error %d\n", errno);
+            pstate->ret = -EIO;
+            atomic_store(&pshared->failed, 1);
+            break;
+        }
+        else
+            poll(&pfd, 1, CONSUMER_POLL_TIMEOUT_MS);
+    }
+
+    if (pshared->mode != BENCH_MULTI)
+        close(fd);
+    return NULL;
+}
+
+// Producers and consumers moving data through a single context (a file per thread except for multi mode)
+static int bench_threads(enum bench_mode mode, int producers, int consumers)
+{
+    struct bench_threads shared = {0};
+    struct bench_thread *pthreads;
+    struct bench_samples samples;
+    pthread_t *ptids;
+    uint64_t start, elapsed;
+    int count = producers + consumers, created, i, ret = 0;
+
+    shared.mode = mode;
+    shared.fd = -1;
+    shared.iterations = iterations;
+    shared.total = (uint64_t)producers * iterations * THREADS_CHUNK_SIZE;
+    if (mode == BENCH_MULTI)
+        RETURN_ON_ERROR(shared.fd = open_mode(mode, O_NONBLOCK));
+
+    pthreads = calloc(count, sizeof(*pthreads));
+    ptids = calloc(count, sizeof(*ptids));
+    if (pthreads == NULL || ptids == NULL) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+    for (i = 0; i < count; i++) {
+        pthreads[i].pshared = &shared;
+        // A consumer may get a chunk in pieces, so it can do more reads than a producer does writes
+        if (samples_alloc(&pthreads[i].samples, iterations * 2) < 0) {
+            ret = -ENOMEM;
+            goto out_free;
+        }
+    }
+
+    pthread_barrier_init(&shared.start, NULL, count + 1);
+    for (created = 0; created < count; created++) {
+        if (pthread_create(&ptids[created], NULL, created < producers ? producer_fn : consumer_fn, &pthreads[created])) {
+            // The started threads wait for the missing ones at the barrier forever
+            printf("Failed to create thread\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&shared.start);
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        pthread_join(ptids[i], NULL);
+    elapsed = now_ns() - start;
+    pthread_barrier_destroy(&shared.start);
+
+    // A failure of any thread makes the results of the others meaningless
+    for (i = 0; i < count; i++) {
+        if (pthreads[i].ret < 0) {
+            ret = pthreads[i].ret;
+            goto out_free;
+        }
+    }
+
+    // Latency is reported per write, throughput per written chunk
+    if (samples_alloc(&samples, (size_t)producers * iterations) < 0) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+    for (i = 0; i < producers; i++) {
+        memcpy(samples.ns + samples.count, pthreads[i].samples.ns, pthreads[i].samples.count * sizeof(*samples.ns));
+        samples.count += pthreads[i].samples.count;
+    }
+    result_add("threads", mode, THREADS_CHUNK_SIZE, producers, consumers, (uint64_t)producers * iterations, shared.total,
+        elapsed, &samples);
+    free(samples.ns);
+
+out_free:
+    for (i = 0; pthreads && i < count; i++)
+        free(pthreads[i].samples.ns);
+    free(pthreads);
+    free(ptids);
+    if (shared.fd >= 0)
+        close(shared.fd);
+    return ret;
+}
+
+// Opening and closing a file as fast as possible
+static int bench_churn(enum bench_mode mode)
+{
+    struct bench_samples samples;
+    uint64_t start, t;
+    size_t i;
+    int fd;
+
+    RETURN_ON_ERROR(samples_alloc(&samples, iterations));
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        t = now_ns();
+        fd = open_mode(mode, 0);
+        if (fd < 0) {
+            free(samples.ns);
+            return fd;
+        }
+        close(fd);
+        samples.ns[samples.count++] = now_ns() - t;
+    }
+    result_add("open_close", mode, 0, 0, 0, iterations, 0, now_ns() - start, &samples);
+    free(samples.ns);
+    return 0;
+}
+
+static void print_table(void)
+{
+    struct bench_result *presult;
+    int i;
+
+    printf("%-12s %-10s %8s %4s %4s %12s %10s %10s %10s %10s\n",
+        "case", "mode", "size", "prod", "cons", "ops/s", "MB/s", "p50 ns", "p99 ns", "p999 ns");
+    for (i = 0; i < results_count; i++) {
+        presult = &results[i];
+        printf("%-12s %-10s %8zu %4d %4d %12.0f %10.2f %10llu %10llu %10llu\n",
+            presult->name, bench_mode_names[presult->mode], presult->size, presult->producers, presult->consumers,
+            presult->ops / presult->seconds, presult->bytes / presult->seconds / 1e6,
+            (unsigned long long)presult->p50, (unsigned long long)presult->p99, (unsigned long long)presult->p999);
+    }
+}
+
+static int write_json(const char *path)
+{
+    struct bench_result *presult;
+    FILE *pout;
+    int i;
+
+    pout = fopen(path, "w");
+    if (pout == NULL) {
+        printf("Opening %s: error %d\n", path, errno);
+        return -errno;
+    }
+    fprintf(pout, "{\n  \"iterations\": %zu,\n  \"results\": [\n", iterations);
+    for (i = 0; i < results_count; i++) {
+        presult = &results[i];
+        fprintf(pout, "    {\"case\": \"%s\", \"mode\": \"%s\", \"size\": %zu, \"producers\": %d, \"consumers\": %d, "
+            "\"ops\": %llu, \"bytes\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+            "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}%s\n",
+            presult->name, bench_mode_names[presult->mode], presult->size, presult->producers, presult->consumers,
+            (unsigned long long)presult->ops, (unsigned long long)presult->bytes, presult->seconds,
+            presult->ops / presult->seconds, presult->bytes / presult->seconds / 1e6,
+            (unsigned long long)presult->p50, (unsigned long long)presult->p99, (unsigned long long)presult->p999,
+            i + 1 < results_count ? "," : "");
+    }
+    fprintf(pout, "  ]\n}\n");
+    fclose(pout);
+    return 0;
+}
+
+static void usage(const char *pname)
+{
+    printf("Usage: %s [-n iterations] [-t max_threads] [-o results.json]\n", pname);
+    printf("  -n  operations per case and thread (default %d)\n", DEFAULT_ITERATIONS);
+    printf("  -t  largest number of producer and of consumer threads, doubled from 1 (default %d)\n", DEFAULT_MAX_THREADS);
+    printf("  -o  write the results as JSON to the file\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *pjson_path = NULL;
+    int opt, mode, producers, consumers;
+
+    while ((opt = getopt(argc, argv, "n:t:o:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'o':
+            pjson_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (iterations == 0 || max_threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    RETURN_ON_ERROR(clear_shared());
+    for (mode = 0; mode < BENCH_MODES; mode++)
+        RETURN_ON_ERROR(bench_sizes(mode));
+    // Exclusive mode allows a single file, so it has no producer/consumer cases
+    for (producers = 1; producers <= max_threads; producers *= 2) {
+        for (consumers = 1; consumers <= max_threads; consumers *= 2) {
+            RETURN_ON_ERROR(bench_threads(BENCH_SHARED, producers, consumers));
+            RETURN_ON_ERROR(bench_threads(BENCH_MULTI, producers, consumers));
+        }
+    }
+    for (mode = 0; mode < BENCH_MODES; mode++)
+        RETURN_ON_ERROR(bench_churn(mode));
+
+    print_table();
+    if (pjson_path)
+        RETURN_ON_ERROR(write_json(pjson_path));
+
+    return 0;
+}
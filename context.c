@@ -2,109 +2,1663 @@
 
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/preempt.h>
+#include <linux/atomic.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
 
 #include "context.h"
+#include "litechr_trace.h"
 
-// Initialize file context
-void file_context_init(struct file_context *pfile_ctx)
+// Copy bytes to the ring storage starting at free running index pos
+static void data_queue_copy_in(struct data_queue *pqueue, unsigned int pos, const char *kbuf, size_t length)
 {
-    INIT_LIST_HEAD(&pfile_ctx->data_queue.head);
-    pfile_ctx->data_queue.ptail = &pfile_ctx->data_queue.head;
-    pfile_ctx->data_queue.size = 0;
-    mutex_init(&pfile_ctx->data_queue.mtx);
-    INIT_LIST_HEAD(&pfile_ctx->ctx_head);
+    size_t offset = pos & (pqueue->capacity - 1);
+    size_t chunk = min(length, pqueue->capacity - offset);
+
+    // Writers allocate missing data pages first, this only keeps a NULL ring from being written
+    if (unlikely(pqueue->buf == NULL))
+        return;
+    // The second chunk is only non-empty when the data wraps around the ring end
+    memcpy(pqueue->buf + offset, kbuf, chunk);
+    memcpy(pqueue->buf, kbuf + chunk, length - chunk);
+}
+
+// Copy bytes from the ring storage starting at free running index pos
+static void data_queue_copy_out(const struct data_queue *pqueue, unsigned int pos, char *kbuf, size_t length)
+{
+    size_t offset = pos & (pqueue->capacity - 1);
+    size_t chunk = min(length, pqueue->capacity - offset);
+
+    if (length == 0)
+        return;
+    // Indexes written through a mapping of the header alone may claim data of a queue without data pages
+    if (unlikely(pqueue->buf == NULL)) {
+        memset(kbuf, 0, length);
+        return;
+    }
+    memcpy(kbuf, pqueue->buf + offset, chunk);
+    memcpy(kbuf + chunk, pqueue->buf, length - chunk);
+}
+
+// Copy bytes from the ring storage to user buffer starting at free running index pos
+// Returns number of bytes that could not be copied
+static size_t data_queue_copy_to_user(const struct data_queue *pqueue, unsigned int pos, char __user *pbuf, size_t length)
+{
+    size_t offset = pos & (pqueue->capacity - 1);
+    size_t chunk = min(length, pqueue->capacity - offset);
+
+    if (length == 0)
+        return 0;
+    // Data claimed by bogus indexes of a queue without data pages can not be copied
+    if (unlikely(pqueue->buf == NULL))
+        return length;
+    if (copy_to_user(pbuf, pqueue->buf + offset, chunk))
+        return length;
+    return copy_to_user(pbuf + chunk, pqueue->buf, length - chunk);
+}
+
+// Copy bytes from the ring storage to I/O iterator starting at free running index pos
+// The iterator is advanced by the copied bytes
+// Returns number of bytes that could not be copied
+static size_t data_queue_copy_to_iter(const struct data_queue *pqueue, unsigned int pos, struct iov_iter *piter, size_t length)
+{
+    size_t offset = pos & (pqueue->capacity - 1);
+    size_t chunk = min(length, pqueue->capacity - offset);
+    size_t copied;
+
+    if (length == 0)
+        return 0;
+    // Data claimed by bogus indexes of a queue without data pages can not be copied
+    if (unlikely(pqueue->buf == NULL))
+        return length;
+    copied = copy_to_iter(pqueue->buf + offset, chunk, piter);
+    if (copied != chunk)
+        return length - copied;
+    return length - chunk - copy_to_iter(pqueue->buf, length - chunk, piter);
+}
+
+// Copy bytes from I/O iterator to the ring storage starting at free running index pos
+// The iterator is advanced by the copied bytes
+// Returns number of bytes that could not be copied
+static size_t data_queue_copy_from_iter(struct data_queue *pqueue, unsigned int pos, struct iov_iter *piter, size_t length)
+{
+    size_t offset = pos & (pqueue->capacity - 1);
+    size_t chunk = min(length, pqueue->capacity - offset);
+    size_t copied;
+
+    // Writers allocate missing data pages first
+    if (unlikely(pqueue->buf == NULL))
+        return length;
+    copied = copy_from_iter(pqueue->buf + offset, chunk, piter);
+    if (copied != chunk)
+        return length - copied;
+    return length - chunk - copy_from_iter(pqueue->buf, length - chunk, piter);
+}
+
+// Charge the data pages of a data queue to its budget
+// Returns 0 or -ENOBUFS if the budget is exhausted
+static int data_queue_budget_charge(struct data_queue *pqueue)
+{
+    struct file_context_budget *pbudget = pqueue->pbudget;
+
+    if (pbudget == NULL)
+        return 0;
+    // Charging before the check keeps concurrent allocations from exceeding the limit together,
+    // the per CPU counters are only summed up precisely when the approximate sum gets close to the limit
+    percpu_counter_add_batch(&pbudget->used, pqueue->capacity, FILE_CONTEXT_BUDGET_BATCH);
+    if (pbudget->limit && __percpu_counter_compare(&pbudget->used, pbudget->limit, FILE_CONTEXT_BUDGET_BATCH) > 0) {
+        percpu_counter_add_batch(&pbudget->used, -(s64)pqueue->capacity, FILE_CONTEXT_BUDGET_BATCH);
+        return -ENOBUFS;
+    }
+    return 0;
+}
+
+// Return the data pages of a data queue to its budget
+static void data_queue_budget_uncharge(struct data_queue *pqueue)
+{
+    if (pqueue->pbudget)
+        percpu_counter_add_batch(&pqueue->pbudget->used, -(s64)pqueue->capacity, FILE_CONTEXT_BUDGET_BATCH);
 }
 
-// Add new file context to the list and return its pointer
-struct file_context* file_context_add(struct file_context *pmain_file_ctx)
+// Free data pages of a data queue (the ring pages array and the header page are kept)
+static void data_queue_storage_free(struct data_queue *pqueue)
 {
-    struct file_context *pnew_file_ctx;
+    unsigned int i;
 
-    pnew_file_ctx = kzalloc(sizeof(struct file_context), GFP_KERNEL);
-    if (pnew_file_ctx == NULL)
-        return ERR_PTR(-ENOMEM);
+    // Multiple data pages are mapped to a contiguous kernel address range
+    if (pqueue->nr_pages > 2 && pqueue->buf)
+        vunmap(pqueue->buf);
+    // Only completely allocated data pages are charged
+    if (pqueue->buf)
+        data_queue_budget_uncharge(pqueue);
+    pqueue->buf = NULL;
+    for (i = 1; i < pqueue->nr_pages; i++) {
+        if (pqueue->pages[i])
+            __free_page(pqueue->pages[i]);
+        pqueue->pages[i] = NULL;
+    }
+}
+
+// Allocate data pages of a data queue (the ring pages array and the header page exist already)
+// The pages are charged to the budget of the queue and to the memory cgroup of the allocating task
+// Returns 0, -ENOBUFS if the budget is exhausted or -ENOMEM
+static int data_queue_storage_alloc(struct data_queue *pqueue)
+{
+    unsigned int i;
+    char *pbuf;
+    int ret;
+
+    ret = data_queue_budget_charge(pqueue);
+    if (ret < 0)
+        return ret;
+    for (i = 1; i < pqueue->nr_pages; i++) {
+        pqueue->pages[i] = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        if (pqueue->pages[i] == NULL)
+            goto err_free;
+    }
+    if (pqueue->nr_pages == 2)
+        pbuf = page_address(pqueue->pages[1]);
+    else
+        pbuf = vmap(pqueue->pages + 1, pqueue->nr_pages - 1, VM_MAP, PAGE_KERNEL);
+    if (pbuf == NULL)
+        goto err_free;
+    pqueue->buf = pbuf;
+    return 0;
 
-    file_context_init(pnew_file_ctx);
+err_free:
+    data_queue_storage_free(pqueue);
+    data_queue_budget_uncharge(pqueue);
+    return -ENOMEM;
+}
+
+// Free data queue ring pages (except the header page and timestamps if they are kept for a new ring)
+static void data_queue_free(struct data_queue *pqueue, bool keep_header)
+{
+    if (!keep_header) {
+        kfree(pqueue->pstamps);
+        pqueue->pstamps = NULL;
+    }
+    if (pqueue->pages == NULL)
+        return;
+    data_queue_storage_free(pqueue);
+    if (!keep_header && pqueue->pages[0])
+        __free_page(pqueue->pages[0]);
+    kfree(pqueue->pages);
+    pqueue->pages = NULL;
+    pqueue->phdr = NULL;
+}
+
+// Allocate data queue ring pages for size bytes (the data pages only if requested, charged to the budget set already)
+// A header page of an existing ring can be reused, otherwise a new one is allocated
+// Returns 0 or negative error
+static int data_queue_alloc(struct data_queue *pqueue, size_t size, struct page *pheader_page, bool storage)
+{
+    int ret = -ENOMEM;
+
+    // Ring data is rounded up to a power of two so indexes can be masked, and to whole pages so it can be mapped
+    pqueue->capacity = max_t(size_t, roundup_pow_of_two(size), PAGE_SIZE);
+    pqueue->limit = size;
+    pqueue->nr_pages = 1 + (pqueue->capacity >> PAGE_SHIFT);
+    pqueue->buf = NULL;
+    pqueue->pages = kcalloc(pqueue->nr_pages, sizeof(struct page *), GFP_KERNEL_ACCOUNT);
+    if (pqueue->pages == NULL)
+        return -ENOMEM;
+    pqueue->pages[0] = pheader_page ? pheader_page : alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+    if (pqueue->pages[0] == NULL)
+        goto err_free;
+    pqueue->phdr = page_address(pqueue->pages[0]);
+    if (storage && (ret = data_queue_storage_alloc(pqueue)) < 0)
+        goto err_free;
+    return 0;
+
+err_free:
+    data_queue_free(pqueue, pheader_page != NULL);
+    return ret;
+}
+
+// Initialize data queue able to hold size bytes (timestamping the written chunks if requested)
+// The data pages are only allocated if requested, they are charged to the budget if one is given
+// Returns 0 or negative error
+static int data_queue_init(struct data_queue *pqueue, size_t size, bool stamps, bool storage,
+    struct file_context_budget *pbudget)
+{
+    int ret;
+
+    pqueue->pstamps = NULL;
+    pqueue->pbudget = pbudget;
+    ret = data_queue_alloc(pqueue, size, NULL, storage);
+    if (ret < 0)
+        return ret;
+    if (stamps) {
+        pqueue->pstamps = kcalloc(DATA_QUEUE_STAMPS, sizeof(struct data_queue_stamp), GFP_KERNEL_ACCOUNT);
+        if (pqueue->pstamps == NULL) {
+            data_queue_free(pqueue, false);
+            return -ENOMEM;
+        }
+    }
+    pqueue->stamps_head = 0;
+    pqueue->stamps_tail = 0;
+    pqueue->stamps_dropped = 0;
+    pqueue->phdr->capacity = pqueue->capacity;
+    pqueue->phdr->limit = pqueue->limit;
+    atomic_set(&pqueue->mmap_count, 0);
+    mutex_init(&pqueue->map_mtx);
+    mutex_init(&pqueue->mtx);
+    pqueue->spsc = false;
+    mutex_init(&pqueue->rd_mtx);
+    mutex_init(&pqueue->wr_mtx);
+    init_waitqueue_head(&pqueue->rd_wq);
+    init_waitqueue_head(&pqueue->wr_wq);
+    return 0;
+}
+
+// Initialize file context budget of limit bytes of data pages (0 if not limited)
+// Returns 0 or -ENOMEM
+int file_context_budget_init(struct file_context_budget *pbudget, size_t limit)
+{
+    pbudget->limit = limit;
+    return percpu_counter_init(&pbudget->used, 0, GFP_KERNEL);
+}
+
+// Destroy file context budget (all the data pages charged to it must be freed already)
+void file_context_budget_destroy(struct file_context_budget *pbudget)
+{
+    percpu_counter_destroy(&pbudget->used);
+}
+
+// Number of bytes of data pages charged to the file context budget
+size_t file_context_budget_used(struct file_context_budget *pbudget)
+{
+    return percpu_counter_sum_positive(&pbudget->used);
+}
+
+// Free the data pages of a lazily allocated file context once it stayed empty without writes between two checks
+static void file_context_storage_work(struct work_struct *pwork)
+{
+    struct file_context *pfile_ctx = container_of(to_delayed_work(pwork), struct file_context, storage.work);
+    unsigned int head = READ_ONCE(pfile_ctx->data_queue.phdr->head);
+
+    // A queue in use keeps its pages and is checked again later (the next write queues the check once they are freed)
+    if (head != pfile_ctx->storage.head || !file_context_storage_reclaim(pfile_ctx)) {
+        pfile_ctx->storage.head = head;
+        queue_delayed_work(system_wq, &pfile_ctx->storage.work, pfile_ctx->storage.idle);
+    }
+}
+
+// Initialize file context with a data queue able to hold size bytes (measuring read latency if requested)
+// With non-zero idle_ms the data pages are only allocated by the first write and freed again
+// once the queue stayed empty without writes for about idle_ms milliseconds
+// The data pages are charged to the budget if one is given
+// Returns 0, -ENOBUFS if the budget is exhausted or other negative error
+int file_context_init(struct file_context *pfile_ctx, size_t size, bool latency, unsigned int idle_ms,
+    struct file_context_budget *pbudget)
+{
+    int ret;
+
+    pfile_ctx->platency = NULL;
+    if (latency) {
+        pfile_ctx->platency = kzalloc(sizeof(struct file_context_latency), GFP_KERNEL_ACCOUNT);
+        if (pfile_ctx->platency == NULL)
+            return -ENOMEM;
+    }
+    pfile_ctx->pstats = alloc_percpu_gfp(struct file_context_stats, GFP_KERNEL_ACCOUNT);
+    if (pfile_ctx->pstats == NULL) {
+        ret = -ENOMEM;
+        goto err_free_latency;
+    }
+    ret = data_queue_init(&pfile_ctx->data_queue, size, latency, idle_ms == 0, pbudget);
+    if (ret < 0)
+        goto err_free_stats;
+    pfile_ctx->storage.idle = idle_ms ? msecs_to_jiffies(idle_ms) : 0;
+    pfile_ctx->storage.head = 0;
+    INIT_DELAYED_WORK(&pfile_ctx->storage.work, file_context_storage_work);
+    pfile_ctx->shards.queues = NULL;
+    pfile_ctx->shards.count = 0;
+    pfile_ctx->flags = 0;
+    pfile_ctx->id = 0;
+    pfile_ctx->max_size = 0;
+    pfile_ctx->lease.powner = NULL;
+    INIT_LIST_HEAD(&pfile_ctx->cursors);
+    return 0;
+
+err_free_stats:
+    free_percpu(pfile_ctx->pstats);
+    pfile_ctx->pstats = NULL;
+err_free_latency:
+    kfree(pfile_ctx->platency);
+    pfile_ctx->platency = NULL;
+    return ret;
+}
+
+// Add counters to the given ones
+static void file_context_stats_add(struct file_context_stats *pstats, const struct file_context_stats *padded)
+{
+    pstats->read_bytes += padded->read_bytes;
+    pstats->reads += padded->reads;
+    pstats->write_bytes += padded->write_bytes;
+    pstats->writes += padded->writes;
+    pstats->lock_contended += padded->lock_contended;
+}
+
+// Add up counters of the file context from all CPUs to the given ones
+void file_context_stats_sum(struct file_context *pfile_ctx, struct file_context_stats *pstats)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        file_context_stats_add(pstats, per_cpu_ptr(pfile_ctx->pstats, cpu));
+}
+
+// Number of chunks of the file context that were not timestamped
+unsigned long file_context_stamps_dropped(struct file_context *pfile_ctx)
+{
+    unsigned long dropped = READ_ONCE(pfile_ctx->data_queue.stamps_dropped);
+    unsigned int i;
+
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        dropped += READ_ONCE(pfile_ctx->shards.queues[i].stamps_dropped);
+    return dropped;
+}
+
+// Reset latency histogram of the file context
+// The context must be locked for reading
+void file_context_latency_reset(struct file_context *pfile_ctx)
+{
+    if (pfile_ctx->platency)
+        memset(pfile_ctx->platency, 0, sizeof(struct file_context_latency));
+}
+
+// Number of bytes stored in the file context (can be used without locking)
+size_t file_context_size(struct file_context *pfile_ctx)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    if (pfile_ctx->shards.count == 0)
+        return data_queue_size(&pfile_ctx->data_queue);
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        size += data_queue_size(&pfile_ctx->shards.queues[i]);
+    return size;
+}
+
+// Allocate the data pages of a lazily allocated file context if they are not allocated
+// The mapping mutex of the data queue must be held
+// Returns 0, -ENOBUFS if the file context budget is exhausted or -ENOMEM
+int file_context_storage_get(struct file_context *pfile_ctx)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    int ret;
+
+    if (pqueue->buf)
+        return 0;
+    // A queue without data pages is empty, indexes changed through a mapping of the header alone are dropped
+    smp_store_release(&pqueue->phdr->tail, READ_ONCE(pqueue->phdr->head));
+    // Readers do not look at the pages before the write index is moved past the written data
+    ret = data_queue_storage_alloc(pqueue);
+    if (ret < 0)
+        return ret;
+    // The idle check starts from the current write index, so the pages are kept for at least one check period
+    // (pages of a context keeping its storage are only allocated again for the next owner of a pooled context)
+    pfile_ctx->storage.head = READ_ONCE(pqueue->phdr->head);
+    if (pfile_ctx->storage.idle)
+        queue_delayed_work(system_wq, &pfile_ctx->storage.work, pfile_ctx->storage.idle);
+    return 0;
+}
+
+// Allocate the data pages of a lazily allocated file context for a writer
+// The context must be locked for writing
+// Returns 0, -ENOBUFS if the file context budget is exhausted or -ENOMEM
+static int file_context_storage_get_writer(struct file_context *pfile_ctx)
+{
+    int ret;
+
+    mutex_lock(&pfile_ctx->data_queue.map_mtx);
+    ret = file_context_storage_get(pfile_ctx);
+    mutex_unlock(&pfile_ctx->data_queue.map_mtx);
+    return ret;
+}
+
+// Free the data pages of a lazily allocated file context if it is empty, not mapped and not locked by anybody
+// Can be used without locking
+// Returns true if the data pages are not allocated (any more)
+bool file_context_storage_reclaim(struct file_context *pfile_ctx)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    bool reclaimed = false;
+
+    // A queue in use is left alone instead of waiting for it
+    if (!mutex_trylock(&pqueue->mtx))
+        return false;
+    if (!mutex_trylock(&pqueue->wr_mtx))
+        goto unlock_mtx;
+    if (!mutex_trylock(&pqueue->rd_mtx))
+        goto unlock_wr;
+    // A mapping being set up may be about to insert the pages
+    if (!mutex_trylock(&pqueue->map_mtx))
+        goto unlock_rd;
+    // The pages are kept while they hold data (leased bytes included) or are mapped to user space
+    if (pqueue->buf && pfile_ctx->storage.idle && data_queue_size(pqueue) == 0 && !atomic_read(&pqueue->mmap_count))
+        data_queue_storage_free(pqueue);
+    reclaimed = pqueue->buf == NULL;
+    mutex_unlock(&pqueue->map_mtx);
+unlock_rd:
+    mutex_unlock(&pqueue->rd_mtx);
+unlock_wr:
+    mutex_unlock(&pqueue->wr_mtx);
+unlock_mtx:
+    mutex_unlock(&pqueue->mtx);
+    return reclaimed;
+}
+
+// Number of bytes of memory used by a data queue (can be used without locking)
+static size_t data_queue_memory(const struct data_queue *pqueue)
+{
+    size_t memory = PAGE_SIZE + READ_ONCE(pqueue->nr_pages) * sizeof(struct page *);
+
+    if (READ_ONCE(pqueue->buf))
+        memory += READ_ONCE(pqueue->capacity);
+    if (pqueue->pstamps)
+        memory += DATA_QUEUE_STAMPS * sizeof(struct data_queue_stamp);
+    return memory;
+}
+
+// Number of bytes of memory used by the file context (can be used without locking)
+size_t file_context_memory(struct file_context *pfile_ctx)
+{
+    size_t memory = sizeof(struct file_context) + nr_cpu_ids * sizeof(struct file_context_stats);
+    unsigned int i;
+
+    memory += data_queue_memory(&pfile_ctx->data_queue);
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        memory += data_queue_memory(&pfile_ctx->shards.queues[i]);
+    if (pfile_ctx->platency)
+        memory += sizeof(struct file_context_latency);
+    return memory;
+}
+
+// Free sub-queues of a sharded file context
+static void file_context_shards_free(struct file_context *pfile_ctx)
+{
+    unsigned int i;
+
+    if (pfile_ctx->shards.queues == NULL)
+        return;
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        data_queue_free(&pfile_ctx->shards.queues[i], false);
+    kfree(pfile_ctx->shards.queues);
+    pfile_ctx->shards.queues = NULL;
+    pfile_ctx->shards.count = 0;
+}
+
+// Split file context data queue into per CPU sub-queues able to hold size bytes each
+// Returns 0 or negative error
+int file_context_shards_init(struct file_context *pfile_ctx, size_t size, bool strict_order)
+{
+    unsigned int i;
+    int ret;
+
+    // Every chunk of a strictly ordered context carries a header, so the data must fit along with it
+    if (strict_order && size <= SHARD_CHUNK_HEADER_SIZE)
+        return -EINVAL;
+
+    pfile_ctx->shards.queues = kcalloc(nr_cpu_ids, sizeof(struct data_queue), GFP_KERNEL_ACCOUNT);
+    if (pfile_ctx->shards.queues == NULL)
+        return -ENOMEM;
+    pfile_ctx->shards.count = nr_cpu_ids;
+    for (i = 0; i < pfile_ctx->shards.count; i++) {
+        ret = data_queue_init(&pfile_ctx->shards.queues[i], size, pfile_ctx->platency != NULL, true,
+            pfile_ctx->data_queue.pbudget);
+        if (ret < 0) {
+            file_context_shards_free(pfile_ctx);
+            return ret;
+        }
+        // Every sub-queue has a single consumer (readers are serialized by the context) and
+        // writers are serialized by the sub-queue
+        pfile_ctx->shards.queues[i].spsc = true;
+    }
+    pfile_ctx->shards.strict_order = strict_order;
+    atomic64_set(&pfile_ctx->shards.seq, 0);
+    pfile_ctx->shards.next_seq = 0;
+    pfile_ctx->shards.next = 0;
+    pfile_ctx->shards.pcur = NULL;
+    pfile_ctx->shards.cur_left = 0;
+    return 0;
+}
+
+// Free file context storage and the context itself
+static void file_context_free(struct file_context_pool *ppool, struct file_context *pfile_ctx)
+{
+    file_context_shards_free(pfile_ctx);
+    data_queue_free(&pfile_ctx->data_queue, false);
+    free_percpu(pfile_ctx->pstats);
+    kfree(pfile_ctx->platency);
+    kmem_cache_free(ppool->cache, pfile_ctx);
+}
+
+// Number of pooled file contexts the shrinker can free
+static unsigned long file_context_pool_shrink_count(struct shrinker *pshrinker, struct shrink_control *psc)
+{
+    struct file_context_pool *ppool = container_of(pshrinker, struct file_context_pool, shrinker);
+    unsigned int count = READ_ONCE(ppool->count);
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+// Free pooled file contexts under memory pressure
+// Returns number of freed contexts
+static unsigned long file_context_pool_shrink_scan(struct shrinker *pshrinker, struct shrink_control *psc)
+{
+    struct file_context_pool *ppool = container_of(pshrinker, struct file_context_pool, shrinker);
+    struct file_context *pfile_ctx;
+    unsigned long freed = 0;
+
+    while (freed < psc->nr_to_scan) {
+        spin_lock(&ppool->lock);
+        pfile_ctx = ppool->count ? ppool->entries[--ppool->count] : NULL;
+        if (pfile_ctx)
+            ppool->shrunk++;
+        spin_unlock(&ppool->lock);
+        if (pfile_ctx == NULL)
+            break;
+        // The storage is unmapped and freed outside of the pool lock
+        file_context_free(ppool, pfile_ctx);
+        freed++;
+    }
+    return freed ? freed : SHRINK_STOP;
+}
+
+// Create file context cache with a pool of up to max_count contexts able to hold size bytes
+// (measuring read latency if requested and freeing the data pages of idle contexts after idle_ms milliseconds)
+// The pooled contexts are freed under memory pressure, the data pages of all contexts are charged to the budget if one is given
+// Returns 0 or negative error
+int file_context_pool_init(struct file_context_pool *ppool, size_t size, unsigned int max_count, bool latency,
+    unsigned int idle_ms, struct file_context_budget *pbudget)
+{
+    int ret;
+
+    // The contexts are charged to the memory cgroup of the opener
+    ppool->cache = KMEM_CACHE(file_context, SLAB_ACCOUNT);
+    if (ppool->cache == NULL)
+        return -ENOMEM;
+    ppool->entries = NULL;
+    if (max_count) {
+        ppool->entries = kcalloc(max_count, sizeof(struct file_context *), GFP_KERNEL);
+        if (ppool->entries == NULL) {
+            kmem_cache_destroy(ppool->cache);
+            return -ENOMEM;
+        }
+    }
+    ppool->size = size;
+    spin_lock_init(&ppool->lock);
+    ppool->count = 0;
+    ppool->max_count = max_count;
+    ppool->hits = 0;
+    ppool->misses = 0;
+    ppool->drops = 0;
+    memset(&ppool->removed_stats, 0, sizeof(struct file_context_stats));
+    ppool->latency = latency;
+    ppool->idle_ms = idle_ms;
+    ppool->pbudget = pbudget;
+    ppool->shrunk = 0;
+    ppool->shrinker.count_objects = file_context_pool_shrink_count;
+    ppool->shrinker.scan_objects = file_context_pool_shrink_scan;
+    ppool->shrinker.seeks = DEFAULT_SEEKS;
+    ret = register_shrinker(&ppool->shrinker, "litechr-context-pool");
+    if (ret < 0) {
+        kfree(ppool->entries);
+        kmem_cache_destroy(ppool->cache);
+        return ret;
+    }
+    return 0;
+}
+
+// Free pooled file contexts and destroy the cache (all added contexts must be removed already)
+void file_context_pool_destroy(struct file_context_pool *ppool)
+{
+    unregister_shrinker(&ppool->shrinker);
+    while (ppool->count)
+        file_context_free(ppool, ppool->entries[--ppool->count]);
+    kfree(ppool->entries);
+    ppool->entries = NULL;
+    kmem_cache_destroy(ppool->cache);
+    ppool->cache = NULL;
+}
+
+// Add counters of the removed file contexts to the given ones
+void file_context_pool_stats_sum(struct file_context_pool *ppool, struct file_context_stats *pstats)
+{
+    spin_lock(&ppool->lock);
+    file_context_stats_add(pstats, &ppool->removed_stats);
+    spin_unlock(&ppool->lock);
+}
+
+// Number of bytes of memory used by the pooled file contexts
+size_t file_context_pool_memory(struct file_context_pool *ppool)
+{
+    size_t memory = 0;
+    unsigned int i;
+
+    spin_lock(&ppool->lock);
+    for (i = 0; i < ppool->count; i++)
+        memory += file_context_memory(ppool->entries[i]);
+    spin_unlock(&ppool->lock);
+    return memory;
+}
+
+// Prepare a released file context for reuse
+// Returns true if the context can be pooled
+static bool file_context_recycle(struct file_context_pool *ppool, struct file_context *pfile_ctx)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+
+    // Resized contexts would change the memory footprint of the pool
+    if (pfile_ctx->shards.count || pqueue->limit != ppool->size)
+        return false;
+    // The ring is mapped to the next owner as is, so neither the stored data nor
+    // header changes made through a mapping may leak to it (the data pages are allocated zeroed)
+    // The data pages are not kept in the pool, so they do not hold the budget and the next owner allocates them
+    // by its first write, charged to its own memory cgroup
+    data_queue_storage_free(pqueue);
+    pqueue->phdr->head = 0;
+    pqueue->phdr->tail = 0;
+    pqueue->phdr->capacity = pqueue->capacity;
+    pqueue->phdr->limit = pqueue->limit;
+    pqueue->spsc = false;
+    pqueue->stamps_head = 0;
+    pqueue->stamps_tail = 0;
+    pqueue->stamps_dropped = 0;
+    file_context_latency_reset(pfile_ctx);
+    pfile_ctx->lease.powner = NULL;
+    pfile_ctx->flags = 0;
+    pfile_ctx->id = 0;
+    return true;
+}
+
+// Return a released file context to the pool or free it if the pool does not take it
+// Returns true if the context was pooled
+static bool file_context_pool_put(struct file_context_pool *ppool, struct file_context *pfile_ctx)
+{
+    bool pooled = file_context_recycle(ppool, pfile_ctx);
+
+    spin_lock(&ppool->lock);
+    if (pooled && ppool->count < ppool->max_count)
+        ppool->entries[ppool->count++] = pfile_ctx;
+    else {
+        pooled = false;
+        ppool->drops++;
+    }
+    spin_unlock(&ppool->lock);
+
+    if (!pooled)
+        file_context_free(ppool, pfile_ctx);
+    return pooled;
+}
+
+// Take a file context from the pool (or allocate it), register it with an index below max_count and return its pointer
+struct file_context* file_context_add(struct file_context_pool *ppool, struct xarray *pfile_ctxs, u32 max_count)
+{
+    struct file_context *pnew_file_ctx = NULL;
+    bool pooled = false;
+    int ret;
+
+    // Index 0 is left for the static shared context
+    if (max_count <= 1)
+        return ERR_PTR(-EBUSY);
+
+    spin_lock(&ppool->lock);
+    if (ppool->count) {
+        pnew_file_ctx = ppool->entries[--ppool->count];
+        ppool->hits++;
+        pooled = true;
+    }
+    else
+        ppool->misses++;
+    spin_unlock(&ppool->lock);
+
+    // Pooled contexts keep their header page, so only a miss needs allocation (the data pages are allocated by the first write)
+    if (pnew_file_ctx == NULL) {
+        pnew_file_ctx = kmem_cache_zalloc(ppool->cache, GFP_KERNEL);
+        if (pnew_file_ctx == NULL)
+            return ERR_PTR(-ENOMEM);
+
+        ret = file_context_init(pnew_file_ctx, ppool->size, ppool->latency, ppool->idle_ms, ppool->pbudget);
+        if (ret < 0) {
+            kmem_cache_free(ppool->cache, pnew_file_ctx);
+            return ERR_PTR(ret);
+        }
+    }
+
+    // The registry takes its own lock only for the index allocation, the storage is set up already
+    ret = xa_alloc(pfile_ctxs, &pnew_file_ctx->id, pnew_file_ctx, XA_LIMIT(1, max_count - 1), GFP_KERNEL);
+    if (ret < 0) {
+        // Full registry is reported as -EBUSY, a context taken from the pool goes back to it
+        pnew_file_ctx->id = 0;
+        file_context_pool_put(ppool, pnew_file_ctx);
+        return ERR_PTR(ret);
+    }
+
+    trace_litechr_context_add(pnew_file_ctx->id, pooled);
 
-    list_add_tail(&pnew_file_ctx->ctx_head, &pmain_file_ctx->ctx_head);
-    
     return pnew_file_ctx;
 }
 
+// Empty data queue
+static void data_queue_clear(struct data_queue *pqueue)
+{
+    // Dropping the stored bytes only requires moving the read index
+    smp_store_release(&pqueue->phdr->tail, READ_ONCE(pqueue->phdr->head));
+    // Dropped chunks are not measured
+    if (pqueue->pstamps)
+        smp_store_release(&pqueue->stamps_tail, smp_load_acquire(&pqueue->stamps_head));
+}
+
 // Empty data queue of specific file context
 void file_context_data_queue_clear(struct file_context *pfile_ctx)
 {
-    struct data_queue_entry *pentry, *ptentry;
-    size_t count = 0;
-    // Clear data queue
-    list_for_each_entry_safe(pentry, ptentry, &pfile_ctx->data_queue.head, entry_head) {
-        list_del(&pentry->entry_head);
-        kfree(pentry);
-	    count++;
-    }
-    pfile_ctx->data_queue.size = 0;
-    //pr_info("Cleared %ld entries\n", count);
+    unsigned int i;
+
+    if (trace_litechr_context_clear_enabled())
+        trace_litechr_context_clear(pfile_ctx->id, file_context_size(pfile_ctx));
+    data_queue_clear(&pfile_ctx->data_queue);
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        data_queue_clear(&pfile_ctx->shards.queues[i]);
+    // Writers of a sharded context are not excluded, so chunks published after the clear with sequence numbers
+    // taken before it are dropped by the reader instead (chunks with later numbers are kept)
+    pfile_ctx->shards.next_seq = atomic64_read(&pfile_ctx->shards.seq);
+    pfile_ctx->shards.cur_left = 0;
 }
 
-// Remove file context from the list and free it's memory (if not static)
-void file_context_remove(struct file_context *pfile_ctx)
+// Remove file context from the registry and return it to the pool or free it's memory (if not static)
+void file_context_remove(struct file_context_pool *ppool, struct xarray *pfile_ctxs, struct file_context *pfile_ctx)
 {
-    file_context_data_queue_clear(pfile_ctx);
-    // If this is the static list head, leave it alone
-    if (list_empty(&pfile_ctx->ctx_head))
+    struct file_context_stats stats = {0};
+    u32 id = pfile_ctx->id;
+    bool pooled;
+    int cpu;
+
+    // Nobody else may free the data pages any more
+    cancel_delayed_work_sync(&pfile_ctx->storage.work);
+
+    // If this is the static shared context, only free its storage
+    if (!id) {
+        file_context_shards_free(pfile_ctx);
+        data_queue_free(&pfile_ctx->data_queue, false);
+        free_percpu(pfile_ctx->pstats);
+        pfile_ctx->pstats = NULL;
+        kfree(pfile_ctx->platency);
+        pfile_ctx->platency = NULL;
         return;
-    list_del(&pfile_ctx->ctx_head);
-    kfree(pfile_ctx);
+    }
+    xa_erase(pfile_ctxs, id);
+
+    // Move the counters of the context to the totals, so that a reused context starts from zero
+    file_context_stats_sum(pfile_ctx, &stats);
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(pfile_ctx->pstats, cpu), 0, sizeof(struct file_context_stats));
+    pfile_ctx->max_size = 0;
+
+    spin_lock(&ppool->lock);
+    file_context_stats_add(&ppool->removed_stats, &stats);
+    spin_unlock(&ppool->lock);
+
+    pooled = file_context_pool_put(ppool, pfile_ctx);
+
+    trace_litechr_context_remove(id, pooled);
 }
 
-// Read bytes from file context's data queue to kernel buffer
+// Read bytes from file context's data queue to kernel buffer (the context must not be sharded or in record mode)
 // Returns number of bytes actually read
 size_t file_context_data_queue_read_to_buffer(struct file_context *pfile_ctx, char *kbuf, size_t length)
 {
-    size_t buf_len;
-    struct data_queue_entry *pentry;
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int head, tail;
+
+    // Acquire pairs with the producer's release of head, so the data is visible before it is copied
+    head = smp_load_acquire(&pqueue->phdr->head);
+    tail = READ_ONCE(pqueue->phdr->tail);
+    length = min3(length, (size_t)(head - tail), pqueue->limit);
+    data_queue_copy_out(pqueue, tail, kbuf, length);
+    // Release makes sure the data is copied out before the space can be reused
+    smp_store_release(&pqueue->phdr->tail, tail + length);
+    //pr_info("Sending %zu bytes\n", length);
+    return length;
+}
+
+// Write bytes to the end of the data queue (the context must not be sharded or in record mode)
+// Returns number of written bytes (limited by the free space of the queue, 0 if the data pages could not be allocated)
+size_t file_context_data_queue_write_from_buffer(struct file_context *pfile_ctx, const char *kbuf, size_t length)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int head, tail;
 
-    //pr_info("Sending data: ");
-    for (buf_len = 0; buf_len < length && !list_empty(pfile_ctx->data_queue.ptail); ++buf_len) {
-        pentry = list_entry(pfile_ctx->data_queue.ptail, struct data_queue_entry, entry_head);
-        kbuf[buf_len] = pentry->data_byte;
-        pfile_ctx->data_queue.ptail = pfile_ctx->data_queue.ptail->next;
-        list_del(&pentry->entry_head);
-	    pfile_ctx->data_queue.size--;
-        kfree(pentry);
-        //pr_cont("%c (0x%02X) ", kbuf[buf_len], kbuf[buf_len]);
+    if (unlikely(pqueue->buf == NULL) && file_context_storage_get_writer(pfile_ctx) < 0)
+        return 0;
+
+    // Acquire pairs with the consumer's release of tail, so the space is not overwritten while still being read
+    tail = smp_load_acquire(&pqueue->phdr->tail);
+    head = READ_ONCE(pqueue->phdr->head);
+    length = min(length, pqueue->limit - min_t(size_t, head - tail, pqueue->limit));
+    data_queue_copy_in(pqueue, head, kbuf, length);
+    // Release makes sure the data is stored before it can be seen by consumers
+    smp_store_release(&pqueue->phdr->head, head + length);
+    //pr_info("Incoming %zu bytes\n", length);
+    return length;
+}
+
+// Timestamp the chunk being written to data queue up to free running index end
+// Has to be called before the chunk is published, so that the timestamp is seen by the reader of the chunk
+static void data_queue_stamp(struct data_queue *pqueue, unsigned int end)
+{
+    unsigned int head = pqueue->stamps_head;
+    struct data_queue_stamp *pstamp;
+
+    if (pqueue->pstamps == NULL)
+        return;
+    // Acquire pairs with the reader's release of the timestamp tail, so the entry is not overwritten while in use
+    if (head - smp_load_acquire(&pqueue->stamps_tail) == DATA_QUEUE_STAMPS) {
+        // The chunk is measured along with the next timestamped one
+        pqueue->stamps_dropped++;
+        return;
     }
-    //pr_info("");
-    return buf_len;
+    pstamp = &pqueue->pstamps[head & (DATA_QUEUE_STAMPS - 1)];
+    pstamp->end = end;
+    pstamp->time = ktime_get_ns();
+    smp_store_release(&pqueue->stamps_head, head + 1);
 }
 
-// Write bytes as new queue entries
-// Returns number of written bytes or negative error
-ssize_t file_context_data_queue_write_from_buffer(struct file_context *pfile_ctx, char *kbuf, size_t length)
+// Add latency of the chunks completely read from data queue to the histogram
+static void data_queue_latency_fold(struct data_queue *pqueue, struct file_context_latency *platency, u64 now)
 {
-    size_t buf_len;
-    struct data_queue_entry *pnew_entry;
+    unsigned int tail = READ_ONCE(pqueue->phdr->tail);
+    unsigned int stamps_head, stamps_tail = pqueue->stamps_tail;
+    struct data_queue_stamp *pstamp;
+    u64 latency;
 
-    //pr_info("Incoming data: ");
-    for (buf_len = 0; buf_len < length; ++buf_len) {
-        pnew_entry = kzalloc(sizeof(struct data_queue_entry), GFP_KERNEL);
-        if (pnew_entry == NULL) {
-            kfree(kbuf);
-            return -ENOMEM;
+    if (pqueue->pstamps == NULL)
+        return;
+    stamps_head = smp_load_acquire(&pqueue->stamps_head);
+    for (; stamps_tail != stamps_head; stamps_tail++) {
+        pstamp = &pqueue->pstamps[stamps_tail & (DATA_QUEUE_STAMPS - 1)];
+        // Stop at the first chunk that still has bytes in the queue
+        if ((int)(tail - pstamp->end) < 0)
+            break;
+        latency = now > pstamp->time ? now - pstamp->time : 0;
+        platency->buckets[latency ? fls64(latency) - 1 : 0]++;
+    }
+    smp_store_release(&pqueue->stamps_tail, stamps_tail);
+}
+
+// Read bytes from data queue directly to I/O iterator
+// Only the bytes actually copied are removed from the queue
+// Returns number of bytes read (0 if the queue is empty) or -EFAULT if none could be copied
+static ssize_t data_queue_read_to_iter(struct data_queue *pqueue, struct iov_iter *piter, size_t length)
+{
+    unsigned int head, tail;
+
+    head = smp_load_acquire(&pqueue->phdr->head);
+    tail = READ_ONCE(pqueue->phdr->tail);
+    length = min3(length, (size_t)(head - tail), pqueue->limit);
+    if (length == 0)
+        return 0;
+    length -= data_queue_copy_to_iter(pqueue, tail, piter, length);
+    if (length == 0)
+        return -EFAULT;
+    smp_store_release(&pqueue->phdr->tail, tail + length);
+    return length;
+}
+
+// Write bytes from I/O iterator directly to the end of data queue
+// Only the bytes actually copied are added to the queue
+// Returns number of written bytes (limited by the free space of the queue) or -EFAULT if none could be copied
+static ssize_t data_queue_write_from_iter(struct data_queue *pqueue, struct iov_iter *piter, size_t length)
+{
+    unsigned int head, tail;
+
+    tail = smp_load_acquire(&pqueue->phdr->tail);
+    head = READ_ONCE(pqueue->phdr->head);
+    length = min(length, pqueue->limit - min_t(size_t, head - tail, pqueue->limit));
+    if (length == 0)
+        return 0;
+    // The free space is not visible to consumers, so a partially failed copy leaves nothing behind
+    length -= data_queue_copy_from_iter(pqueue, head, piter, length);
+    if (length == 0)
+        return -EFAULT;
+    data_queue_stamp(pqueue, head + length);
+    smp_store_release(&pqueue->phdr->head, head + length);
+    return length;
+}
+
+// Get the length of the oldest record stored in data queue between free running indexes tail and head
+// Returns 1 if there is a record, 0 if the queue is empty or -EIO if the records are corrupted
+static int data_queue_record_peek(const struct data_queue *pqueue, unsigned int head, unsigned int tail, u32 *precord)
+{
+    size_t size = head - tail;
+
+    if (size == 0)
+        return 0;
+    // The ring may be changed through a mapping, so records are checked before use
+    if (size < LITECHR_RECORD_HEADER_SIZE || size > pqueue->limit)
+        return -EIO;
+    data_queue_copy_out(pqueue, tail, (char *)precord, LITECHR_RECORD_HEADER_SIZE);
+    if (*precord > size - LITECHR_RECORD_HEADER_SIZE)
+        return -EIO;
+    return 1;
+}
+
+// Read the oldest record from data queue directly to I/O iterator
+// The part of the record that does not fit the iterator is dropped
+// Returns number of bytes read (0 if the queue is empty) or -EFAULT if none could be copied
+static ssize_t data_queue_record_read_to_iter(struct data_queue *pqueue, struct iov_iter *piter)
+{
+    unsigned int head, tail;
+    size_t length;
+    u32 record;
+    int ret;
+
+    head = smp_load_acquire(&pqueue->phdr->head);
+    tail = READ_ONCE(pqueue->phdr->tail);
+    ret = data_queue_record_peek(pqueue, head, tail, &record);
+    if (ret == 0)
+        return 0;
+    if (ret < 0)
+        goto err_corrupted;
+    length = min_t(size_t, iov_iter_count(piter), record);
+    // A record is either read or left in the queue as a whole
+    if (data_queue_copy_to_iter(pqueue, tail + LITECHR_RECORD_HEADER_SIZE, piter, length))
+        return -EFAULT;
+    smp_store_release(&pqueue->phdr->tail, tail + LITECHR_RECORD_HEADER_SIZE + record);
+    return length;
+
+err_corrupted:
+    // There is no way to find the next record boundary, so drop everything
+    smp_store_release(&pqueue->phdr->tail, head);
+    return -EIO;
+}
+
+// Write the whole I/O iterator to the end of data queue as a single record
+// Returns number of written bytes (0 if the record does not fit) or -EFAULT if the data could not be copied
+static ssize_t data_queue_record_write_from_iter(struct data_queue *pqueue, struct iov_iter *piter)
+{
+    size_t length = iov_iter_count(piter);
+    unsigned int head, tail;
+    u32 record = length;
+
+    tail = smp_load_acquire(&pqueue->phdr->tail);
+    head = READ_ONCE(pqueue->phdr->head);
+    if (LITECHR_RECORD_HEADER_SIZE + length > pqueue->limit - min_t(size_t, head - tail, pqueue->limit))
+        return 0;
+    if (data_queue_copy_from_iter(pqueue, head + LITECHR_RECORD_HEADER_SIZE, piter, length))
+        return -EFAULT;
+    data_queue_copy_in(pqueue, head, (const char *)&record, LITECHR_RECORD_HEADER_SIZE);
+    data_queue_stamp(pqueue, head + LITECHR_RECORD_HEADER_SIZE + length);
+    // The header and the data become visible together
+    smp_store_release(&pqueue->phdr->head, head + LITECHR_RECORD_HEADER_SIZE + length);
+    return length;
+}
+
+// Get the header of the oldest chunk of a strictly ordered sub-queue
+// Returns false if there is no complete chunk
+static bool shard_chunk_peek(struct data_queue *pshard, struct shard_chunk_header *pchunk)
+{
+    unsigned int head, tail;
+
+    head = smp_load_acquire(&pshard->phdr->head);
+    tail = READ_ONCE(pshard->phdr->tail);
+    // Chunk header and data are published together
+    if (head - tail < SHARD_CHUNK_HEADER_SIZE)
+        return false;
+    data_queue_copy_out(pshard, tail, (char *)pchunk, SHARD_CHUNK_HEADER_SIZE);
+    return true;
+}
+
+// Drop the oldest chunk of a strictly ordered sub-queue
+static void shard_chunk_drop(struct data_queue *pshard, const struct shard_chunk_header *pchunk)
+{
+    unsigned int head, tail;
+
+    head = smp_load_acquire(&pshard->phdr->head);
+    tail = READ_ONCE(pshard->phdr->tail);
+    smp_store_release(&pshard->phdr->tail,
+        tail + SHARD_CHUNK_HEADER_SIZE + min_t(size_t, pchunk->length, head - tail - SHARD_CHUNK_HEADER_SIZE));
+}
+
+// Find the sub-queue holding the chunk with the given sequence number at its head
+// Chunks numbered before it were written across a clear of the context and are dropped
+// Returns NULL if the chunk is not complete yet
+static struct data_queue* shard_chunk_find(struct file_context *pfile_ctx, u64 seq)
+{
+    struct shard_chunk_header chunk;
+    struct data_queue *pshard;
+    unsigned int i;
+
+    for (i = 0; i < pfile_ctx->shards.count; i++) {
+        pshard = &pfile_ctx->shards.queues[i];
+        while (shard_chunk_peek(pshard, &chunk) && chunk.seq < seq)
+            shard_chunk_drop(pshard, &chunk);
+        if (shard_chunk_peek(pshard, &chunk) && chunk.seq == seq)
+            return pshard;
+    }
+    return NULL;
+}
+
+// Read bytes from sub-queues of a sharded file context directly to I/O iterator
+// Returns number of bytes read (0 if nothing is available) or -EFAULT if none could be copied
+static ssize_t file_context_shards_read_to_iter(struct file_context *pfile_ctx, struct iov_iter *piter)
+{
+    size_t length = iov_iter_count(piter);
+    struct shard_chunk_header chunk;
+    struct data_queue *pshard;
+    size_t copied = 0;
+    unsigned int i;
+    ssize_t ret;
+
+    if (!pfile_ctx->shards.strict_order) {
+        // Drain sub-queues one after another, starting with the next one on each read
+        for (i = 0; i < pfile_ctx->shards.count && copied < length; i++) {
+            pshard = &pfile_ctx->shards.queues[(pfile_ctx->shards.next + i) % pfile_ctx->shards.count];
+            ret = data_queue_read_to_iter(pshard, piter, length - copied);
+            if (ret < 0)
+                return copied ? copied : ret;
+            copied += ret;
+        }
+        pfile_ctx->shards.next = (pfile_ctx->shards.next + 1) % pfile_ctx->shards.count;
+        return copied;
+    }
+
+    // Take chunks in the order of their sequence numbers
+    while (copied < length) {
+        if (pfile_ctx->shards.cur_left == 0) {
+            // Stop at the first chunk that is not complete yet, even if later ones are
+            pshard = shard_chunk_find(pfile_ctx, pfile_ctx->shards.next_seq);
+            if (pshard == NULL)
+                break;
+            shard_chunk_peek(pshard, &chunk);
+            smp_store_release(&pshard->phdr->tail, READ_ONCE(pshard->phdr->tail) + SHARD_CHUNK_HEADER_SIZE);
+            pfile_ctx->shards.pcur = pshard;
+            pfile_ctx->shards.cur_left = chunk.length;
+            pfile_ctx->shards.next_seq++;
+            continue;
+        }
+        ret = data_queue_read_to_iter(pfile_ctx->shards.pcur, piter,
+            min(pfile_ctx->shards.cur_left, length - copied));
+        if (ret <= 0)
+            return copied ? copied : ret;
+        pfile_ctx->shards.cur_left -= ret;
+        copied += ret;
+    }
+    return copied;
+}
+
+// Write bytes from I/O iterator to a strictly ordered sub-queue as a single chunk
+// Returns number of written bytes or -EFAULT if none could be copied
+static ssize_t shard_chunk_write_from_iter(struct file_context *pfile_ctx, struct data_queue *pshard, struct iov_iter *piter, size_t length)
+{
+    struct shard_chunk_header chunk;
+    unsigned int head, tail;
+    size_t space;
+
+    tail = smp_load_acquire(&pshard->phdr->tail);
+    head = READ_ONCE(pshard->phdr->head);
+    space = pshard->limit - min_t(size_t, head - tail, pshard->limit);
+    if (space <= SHARD_CHUNK_HEADER_SIZE)
+        return 0;
+    length = min(length, space - SHARD_CHUNK_HEADER_SIZE);
+    length -= data_queue_copy_from_iter(pshard, head + SHARD_CHUNK_HEADER_SIZE, piter, length);
+    if (length == 0)
+        return -EFAULT;
+    data_queue_stamp(pshard, head + SHARD_CHUNK_HEADER_SIZE + length);
+    // The reader waits for every sequence number in turn, so keep the time between
+    // taking the number and publishing the chunk short
+    preempt_disable();
+    chunk.seq = atomic64_fetch_inc(&pfile_ctx->shards.seq);
+    chunk.length = length;
+    data_queue_copy_in(pshard, head, (const char *)&chunk, SHARD_CHUNK_HEADER_SIZE);
+    smp_store_release(&pshard->phdr->head, head + SHARD_CHUNK_HEADER_SIZE + length);
+    preempt_enable();
+    return length;
+}
+
+// Check if a read from the file context would return some data (can be used without locking)
+bool file_context_readable(struct file_context *pfile_ctx)
+{
+    unsigned int i;
+
+    // Leased bytes can not be taken by other readers
+    if (file_context_leased(pfile_ctx))
+        return false;
+    if (pfile_ctx->shards.count == 0)
+        return data_queue_size(&pfile_ctx->data_queue) != 0;
+    if (pfile_ctx->shards.strict_order)
+        return READ_ONCE(pfile_ctx->shards.cur_left) != 0 ||
+            shard_chunk_find(pfile_ctx, READ_ONCE(pfile_ctx->shards.next_seq)) != NULL;
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        if (data_queue_size(&pfile_ctx->shards.queues[i]))
+            return true;
+    return false;
+}
+
+// Add latency of the chunks completely read from the file context to its histogram
+static void file_context_latency_fold(struct file_context *pfile_ctx)
+{
+    u64 now = ktime_get_ns();
+    unsigned int i;
+
+    if (pfile_ctx->shards.count == 0) {
+        data_queue_latency_fold(&pfile_ctx->data_queue, pfile_ctx->platency, now);
+        return;
+    }
+    // A read may take chunks from any of the sub-queues
+    for (i = 0; i < pfile_ctx->shards.count; i++)
+        data_queue_latency_fold(&pfile_ctx->shards.queues[i], pfile_ctx->platency, now);
+}
+
+// Number of bytes the next read from the file context can return (the length of the next record in record mode)
+// For a strictly ordered sharded context only the next chunk is counted, so more bytes may be returned
+// The context must be locked for reading
+size_t file_context_read_size(struct file_context *pfile_ctx)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    struct shard_chunk_header chunk;
+    struct data_queue *pshard;
+    u32 record;
+
+    if (pfile_ctx->shards.count == 0) {
+        if (!(pfile_ctx->flags & LITECHR_CTX_RECORDS))
+            return data_queue_size(pqueue);
+        // A corrupted queue is reported as empty, the next read fails
+        if (data_queue_record_peek(pqueue, smp_load_acquire(&pqueue->phdr->head), READ_ONCE(pqueue->phdr->tail), &record) <= 0)
+            return 0;
+        return record;
+    }
+    if (!pfile_ctx->shards.strict_order)
+        return file_context_size(pfile_ctx);
+    if (pfile_ctx->shards.cur_left)
+        return pfile_ctx->shards.cur_left;
+    pshard = shard_chunk_find(pfile_ctx, pfile_ctx->shards.next_seq);
+    if (pshard == NULL)
+        return 0;
+    shard_chunk_peek(pshard, &chunk);
+    return chunk.length;
+}
+
+// Copy bytes (or a single record in record mode) from the head of file context's data queue to user buffer
+// (if any) without removing them
+// The part of the record that does not fit the buffer is not copied
+// Sets the number of queue bytes to be removed along with the copied ones (the whole record in record mode)
+// Returns number of bytes copied (0 if the queue is empty), -EOPNOTSUPP for a sharded context,
+// -EIO if the records are corrupted or -EFAULT if the bytes could not be copied
+static ssize_t file_context_data_queue_head(struct file_context *pfile_ctx, char __user *pbuf, size_t length, size_t *pstored)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int head, tail;
+    u32 record;
+    int ret;
+
+    // The sub-queue a read takes the data from depends on the state of all of them,
+    // and every reader of a broadcast has its own head of the queue
+    if (pfile_ctx->shards.count || (pfile_ctx->flags & LITECHR_CTX_BROADCAST))
+        return -EOPNOTSUPP;
+
+    head = smp_load_acquire(&pqueue->phdr->head);
+    tail = READ_ONCE(pqueue->phdr->tail);
+    if (pfile_ctx->flags & LITECHR_CTX_RECORDS) {
+        ret = data_queue_record_peek(pqueue, head, tail, &record);
+        if (ret <= 0)
+            return ret;
+        tail += LITECHR_RECORD_HEADER_SIZE;
+        length = min_t(size_t, length, record);
+        *pstored = LITECHR_RECORD_HEADER_SIZE + record;
+    }
+    else {
+        length = min3(length, (size_t)(head - tail), pqueue->limit);
+        *pstored = length;
+    }
+    if (pbuf && data_queue_copy_to_user(pqueue, tail, pbuf, length))
+        return -EFAULT;
+    return length;
+}
+
+// Copy bytes (or a single record in record mode) from file context's data queue to user buffer without removing them
+// The part of the record that does not fit the buffer is not copied
+// The context must be locked for reading
+// Returns number of bytes copied (0 if the queue is empty), -EOPNOTSUPP for a sharded context,
+// -EIO if the records are corrupted or -EFAULT if the bytes could not be copied
+ssize_t file_context_data_queue_peek(struct file_context *pfile_ctx, char __user *pbuf, size_t length)
+{
+    size_t stored;
+
+    return file_context_data_queue_head(pfile_ctx, pbuf, length, &stored);
+}
+
+// Check if the file context is leased, ending the lease if its bytes have been committed through the mapping
+// The context must be locked for reading
+static bool file_context_lease_check(struct file_context *pfile_ctx)
+{
+    if (pfile_ctx->lease.powner == NULL)
+        return false;
+    // Moving the mapped tail index commits the leased bytes
+    if (!file_context_leased(pfile_ctx)) {
+        WRITE_ONCE(pfile_ctx->lease.powner, NULL);
+        return false;
+    }
+    return true;
+}
+
+// Lease bytes (or a single record in record mode) at the head of file context's data queue to the owner,
+// copying them to user buffer (if any)
+// Leased bytes stay in the queue, but other readers can not take them until the lease ends
+// The context must be locked for reading
+// Returns number of bytes leased (0 if the queue is empty, no lease is taken then), -EBUSY if the context is leased already,
+// -EOPNOTSUPP for a sharded context, -EIO if the records are corrupted or -EFAULT if the bytes could not be copied
+ssize_t file_context_lease(struct file_context *pfile_ctx, const void *powner, char __user *pbuf, size_t length,
+    unsigned int *ppos)
+{
+    unsigned int tail = READ_ONCE(pfile_ctx->data_queue.phdr->tail);
+    size_t stored;
+    ssize_t ret;
+
+    if (file_context_lease_check(pfile_ctx))
+        return -EBUSY;
+    ret = file_context_data_queue_head(pfile_ctx, pbuf, length, &stored);
+    if (ret <= 0)
+        return ret;
+    // Record data follows the record header
+    *ppos = pfile_ctx->flags & LITECHR_CTX_RECORDS ? tail + LITECHR_RECORD_HEADER_SIZE : tail;
+    pfile_ctx->lease.pos = tail;
+    pfile_ctx->lease.length = stored;
+    // Lockless readers see the lease only along with its position
+    smp_store_release(&pfile_ctx->lease.powner, powner);
+    return ret;
+}
+
+// Remove the first length leased bytes (the whole record in record mode if length is not 0) from the file context
+// and end the lease held by the owner, the rest of the leased bytes is returned to the queue
+// The context must be locked for reading
+// Returns 0, -EINVAL if the owner holds no lease or length exceeds it
+int file_context_lease_commit(struct file_context *pfile_ctx, const void *powner, size_t length)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+
+    if (!file_context_lease_check(pfile_ctx) || pfile_ctx->lease.powner != powner || length > pfile_ctx->lease.length)
+        return -EINVAL;
+    if (length && (pfile_ctx->flags & LITECHR_CTX_RECORDS))
+        length = pfile_ctx->lease.length;
+    WRITE_ONCE(pfile_ctx->lease.powner, NULL);
+    if (length == 0)
+        return 0;
+    // Release makes sure the leased bytes are not overwritten before the lease ends
+    smp_store_release(&pqueue->phdr->tail, pfile_ctx->lease.pos + length);
+    if (pfile_ctx->flags & LITECHR_CTX_RECORDS)
+        length -= LITECHR_RECORD_HEADER_SIZE;
+    this_cpu_add(pfile_ctx->pstats->read_bytes, length);
+    this_cpu_inc(pfile_ctx->pstats->reads);
+    if (pfile_ctx->platency)
+        file_context_latency_fold(pfile_ctx);
+    return 0;
+}
+
+// End the lease of the file context if it is held by the owner, the leased bytes are returned to the queue
+// Can be used without locking, so that the lease of a closed file is always returned
+// Returns true if the lease was held by the owner
+bool file_context_lease_release(struct file_context *pfile_ctx, const void *powner)
+{
+    return cmpxchg(&pfile_ctx->lease.powner, powner, NULL) == powner;
+}
+
+// Start reading a broadcast mode file context at the cursor of a file (does nothing if the cursor is in use already
+// or the context is not in broadcast mode)
+// The context must be locked for reading
+void file_context_cursor_attach(struct file_context *pfile_ctx, struct file_context_cursor *pcursor)
+{
+    if (!(pfile_ctx->flags & LITECHR_CTX_BROADCAST) || !list_empty(&pcursor->node))
+        return;
+    // The stored bytes are kept until every cursor passes them, so the new one can start with the oldest of them
+    pcursor->pos = READ_ONCE(pfile_ctx->data_queue.phdr->tail);
+    pcursor->overrun = false;
+    list_add_tail(&pcursor->node, &pfile_ctx->cursors);
+}
+
+// Remove the bytes all the cursors of broadcast mode file context have passed
+// The context must be locked for reading
+static void file_context_cursors_reclaim(struct file_context *pfile_ctx)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int tail = READ_ONCE(pqueue->phdr->tail);
+    struct file_context_cursor *pcursor;
+    unsigned int distance = UINT_MAX;
+
+    // Without readers the bytes are kept for the next one
+    if (list_empty(&pfile_ctx->cursors))
+        return;
+    // Cursors behind the tail (whose bytes were dropped) are far ahead in the free running index space
+    list_for_each_entry(pcursor, &pfile_ctx->cursors, node)
+        distance = min(distance, pcursor->pos - tail);
+    if (distance == 0 || distance > pqueue->limit)
+        return;
+    smp_store_release(&pqueue->phdr->tail, tail + distance);
+    if (pfile_ctx->platency)
+        file_context_latency_fold(pfile_ctx);
+}
+
+// Stop reading the file context at the cursor, so that the bytes not read yet do not have to be kept for it
+// Takes the data queue mutex (without being interrupted) if the cursor is in use
+void file_context_cursor_detach(struct file_context *pfile_ctx, struct file_context_cursor *pcursor)
+{
+    if (list_empty(&pcursor->node))
+        return;
+    // Broadcast contexts are never in single opener mode, so the mutex excludes both readers and writers
+    mutex_lock(&pfile_ctx->data_queue.mtx);
+    list_del_init(&pcursor->node);
+    file_context_cursors_reclaim(pfile_ctx);
+    mutex_unlock(&pfile_ctx->data_queue.mtx);
+}
+
+// Check the cursor of a file against the stored bytes, moving it to the oldest of them if the bytes at it were dropped
+// Returns false if the bytes at the cursor were dropped
+static bool file_context_cursor_check(struct file_context *pfile_ctx, struct file_context_cursor *pcursor, unsigned int head)
+{
+    unsigned int tail = READ_ONCE(pfile_ctx->data_queue.phdr->tail);
+
+    // The queue may also be emptied by clearing it or through the mapping
+    if (pcursor->overrun || pcursor->pos - tail > head - tail) {
+        pcursor->pos = tail;
+        pcursor->overrun = false;
+        return false;
+    }
+    return true;
+}
+
+// Number of bytes the next read at the cursor of a file can return (the length of the next record in record mode)
+// The context must be locked for reading
+size_t file_context_cursor_read_size(struct file_context *pfile_ctx, struct file_context_cursor *pcursor)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int head = smp_load_acquire(&pqueue->phdr->head);
+    unsigned int pos;
+    u32 record;
+
+    if (list_empty(&pcursor->node))
+        return file_context_read_size(pfile_ctx);
+    // The next read reports the dropped bytes
+    pos = READ_ONCE(pcursor->pos);
+    if (pcursor->overrun || pos - READ_ONCE(pqueue->phdr->tail) > head - READ_ONCE(pqueue->phdr->tail))
+        return 0;
+    if (!(pfile_ctx->flags & LITECHR_CTX_RECORDS))
+        return head - pos;
+    if (data_queue_record_peek(pqueue, head, pos, &record) <= 0)
+        return 0;
+    return record;
+}
+
+// Read bytes (or a single record in record mode) from broadcast mode file context at the cursor directly to I/O iterator
+// The bytes are removed from the queue when all the cursors have passed them
+// The context must be locked for reading
+// Returns number of bytes read (0 if there is nothing new at the cursor), -EPIPE once after bytes not read
+// at the cursor were dropped, -EIO if the records are corrupted or -EFAULT if none could be copied
+ssize_t file_context_cursor_read_to_iter(struct file_context *pfile_ctx, struct file_context_cursor *pcursor, struct iov_iter *piter)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int head, pos;
+    size_t length;
+    ssize_t ret;
+    u32 record;
+
+    file_context_cursor_attach(pfile_ctx, pcursor);
+    head = smp_load_acquire(&pqueue->phdr->head);
+    if (!file_context_cursor_check(pfile_ctx, pcursor, head))
+        return -EPIPE;
+    pos = pcursor->pos;
+
+    if (pfile_ctx->flags & LITECHR_CTX_RECORDS) {
+        ret = data_queue_record_peek(pqueue, head, pos, &record);
+        if (ret == 0)
+            return 0;
+        if (ret < 0)
+            // There is no way to find the next record boundary, so skip everything
+            pcursor->pos = head;
+        else {
+            length = min_t(size_t, iov_iter_count(piter), record);
+            if (data_queue_copy_to_iter(pqueue, pos + LITECHR_RECORD_HEADER_SIZE, piter, length))
+                return -EFAULT;
+            pcursor->pos = pos + LITECHR_RECORD_HEADER_SIZE + record;
+            ret = length;
         }
-        pnew_entry->data_byte = kbuf[buf_len];
-	    INIT_LIST_HEAD(&pnew_entry->entry_head);
-	    if (list_empty(&pfile_ctx->data_queue.head))
-            pfile_ctx->data_queue.ptail = &pnew_entry->entry_head;
-	    list_add_tail(&pnew_entry->entry_head, &pfile_ctx->data_queue.head);
-	    pfile_ctx->data_queue.size++;
-	    //pr_cont("%c (0x%02X) ", kbuf[buf_len], kbuf[buf_len]);
     }
-    //pr_info("");
+    else {
+        length = min3(iov_iter_count(piter), (size_t)(head - pos), pqueue->limit);
+        if (length == 0)
+            return 0;
+        length -= data_queue_copy_to_iter(pqueue, pos, piter, length);
+        if (length == 0)
+            return -EFAULT;
+        pcursor->pos = pos + length;
+        ret = length;
+    }
+    if (ret > 0) {
+        this_cpu_add(pfile_ctx->pstats->read_bytes, ret);
+        this_cpu_inc(pfile_ctx->pstats->reads);
+    }
 
-    return buf_len;
+    // Only the slowest cursor holds the bytes back
+    if (pos == READ_ONCE(pqueue->phdr->tail))
+        file_context_cursors_reclaim(pfile_ctx);
+    return ret;
 }
 
+// Drop the oldest bytes (whole records in record mode) of broadcast mode file context, so that length bytes can be written
+// Cursors at the dropped bytes are moved to the oldest kept byte and get -EPIPE on the next read
+// The context must be locked for writing
+void file_context_broadcast_drop(struct file_context *pfile_ctx, size_t length)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    unsigned int head = READ_ONCE(pqueue->phdr->head);
+    unsigned int tail = READ_ONCE(pqueue->phdr->tail);
+    struct file_context_cursor *pcursor;
+    u32 record;
+
+    length = min(length, pqueue->limit);
+    if (head - tail <= pqueue->limit - length)
+        return;
+    if (pfile_ctx->flags & LITECHR_CTX_RECORDS) {
+        while (head - tail > pqueue->limit - length) {
+            if (data_queue_record_peek(pqueue, head, tail, &record) <= 0) {
+                tail = head;
+                break;
+            }
+            tail += LITECHR_RECORD_HEADER_SIZE + record;
+        }
+    }
+    else
+        tail = head - (pqueue->limit - length);
+    smp_store_release(&pqueue->phdr->tail, tail);
+    list_for_each_entry(pcursor, &pfile_ctx->cursors, node) {
+        if ((int)(pcursor->pos - tail) < 0) {
+            pcursor->pos = tail;
+            WRITE_ONCE(pcursor->overrun, true);
+        }
+    }
+}
+
+// Read bytes (or a single record in record mode) from file context's data queue directly to I/O iterator
+// Only the bytes actually copied are removed from the queue (a record is removed as a whole)
+// Returns number of bytes read (0 if the queue is empty) or -EFAULT if none could be copied
+ssize_t file_context_data_queue_read_to_iter(struct file_context *pfile_ctx, struct iov_iter *piter)
+{
+    ssize_t ret;
+
+    if (pfile_ctx->shards.count)
+        ret = file_context_shards_read_to_iter(pfile_ctx, piter);
+    else if (pfile_ctx->flags & LITECHR_CTX_RECORDS)
+        ret = data_queue_record_read_to_iter(&pfile_ctx->data_queue, piter);
+    else
+        ret = data_queue_read_to_iter(&pfile_ctx->data_queue, piter, iov_iter_count(piter));
+    if (ret > 0) {
+        this_cpu_add(pfile_ctx->pstats->read_bytes, ret);
+        this_cpu_inc(pfile_ctx->pstats->reads);
+        if (pfile_ctx->platency)
+            file_context_latency_fold(pfile_ctx);
+    }
+    return ret;
+}
+
+// Write bytes (or a single record in record mode) from I/O iterator directly to the end of the data queue
+// locked with file_context_lock_writer
+// Only the bytes actually copied are added to the queue (a record is added as a whole)
+// The data pages of an idle context are not allocated by a nowait write, which may not sleep in reclaim
+// Returns number of written bytes (limited by the free space of the queue), -EAGAIN if the data pages are needed by
+// a nowait write, -ENOBUFS or -ENOMEM if they could not be allocated or -EFAULT if none could be copied
+ssize_t file_context_data_queue_write_from_iter(struct file_context *pfile_ctx, struct data_queue *pqueue, struct iov_iter *piter,
+    bool nowait)
+{
+    ssize_t ret;
+    size_t size;
+
+    // Sub-queues always have their data pages
+    if (unlikely(pqueue->buf == NULL)) {
+        if (nowait)
+            return -EAGAIN;
+        ret = file_context_storage_get_writer(pfile_ctx);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (pfile_ctx->shards.count && pfile_ctx->shards.strict_order)
+        ret = shard_chunk_write_from_iter(pfile_ctx, pqueue, piter, iov_iter_count(piter));
+    else if (pfile_ctx->flags & LITECHR_CTX_RECORDS)
+        ret = data_queue_record_write_from_iter(pqueue, piter);
+    else
+        ret = data_queue_write_from_iter(pqueue, piter, iov_iter_count(piter));
+    if (ret > 0) {
+        this_cpu_add(pfile_ctx->pstats->write_bytes, ret);
+        this_cpu_inc(pfile_ctx->pstats->writes);
+        // Writers of different sub-queues may race here, the high-water mark is only an estimate for them
+        size = data_queue_size(pqueue);
+        if (size > READ_ONCE(pfile_ctx->max_size))
+            WRITE_ONCE(pfile_ctx->max_size, size);
+    }
+    return ret;
+}
+
+// Change file context flags
+// The whole queue must be locked
+// Returns 0 or negative error
+int file_context_flags_set(struct file_context *pfile_ctx, unsigned int flags)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    struct file_context_cursor *pcursor, *pnext;
+
+    // The drop policy applies to broadcasts only
+    if ((flags & LITECHR_CTX_BROADCAST_DROP) && !(flags & LITECHR_CTX_BROADCAST))
+        return -EINVAL;
+
+    if ((flags ^ pfile_ctx->flags) & LITECHR_CTX_RECORDS) {
+        // Sub-queues have their own chunk format
+        if (pfile_ctx->shards.count)
+            return -EOPNOTSUPP;
+        // Stored bytes could not be told apart from records
+        if (data_queue_size(pqueue))
+            return -EBUSY;
+        // At least one byte of a record has to fit
+        if ((flags & LITECHR_CTX_RECORDS) && pqueue->limit <= LITECHR_RECORD_HEADER_SIZE)
+            return -EINVAL;
+    }
+    if ((flags ^ pfile_ctx->flags) & LITECHR_CTX_BROADCAST) {
+        if (pfile_ctx->shards.count)
+            return -EOPNOTSUPP;
+        // A single opener has nobody to broadcast to, and its reader does not exclude writers which may drop data
+        if (pqueue->spsc)
+            return -EINVAL;
+        // Readers take the queue from the tail again
+        list_for_each_entry_safe(pcursor, pnext, &pfile_ctx->cursors, node)
+            list_del_init(&pcursor->node);
+    }
+    WRITE_ONCE(pfile_ctx->flags, flags);
+    return 0;
+}
+
+// Change the number of bytes the data queue can hold keeping the stored data
+// The whole queue must be locked (the ring is not replaced while it is being mapped)
+// Returns 0 or negative error
+int file_context_data_queue_resize(struct file_context *pfile_ctx, size_t size)
+{
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    struct data_queue new_queue;
+    unsigned int head, tail, pos;
+    size_t offset, chunk;
+    int ret;
+
+    // At least one byte of a record has to fit
+    if ((pfile_ctx->flags & LITECHR_CTX_RECORDS) && size <= LITECHR_RECORD_HEADER_SIZE)
+        return -EINVAL;
+
+    mutex_lock(&pqueue->map_mtx);
+    // Ring pages can not be replaced under an existing mapping
+    if (atomic_read(&pqueue->mmap_count)) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+
+    tail = smp_load_acquire(&pqueue->phdr->tail);
+    head = READ_ONCE(pqueue->phdr->head);
+    // A queue without data pages is empty whatever its indexes say, so nothing is copied from it
+    if (pqueue->buf == NULL)
+        head = tail;
+    else if (head - tail > pqueue->limit)
+        head = tail + pqueue->limit;
+    // Do not drop the stored data
+    if (size < head - tail) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+
+    // The header page is kept, so lockless waiters may keep looking at the indexes
+    // (data pages freed while idle stay so, the queue is empty then)
+    // Both rings are charged to the budget until the data is copied
+    new_queue.pbudget = pqueue->pbudget;
+    ret = data_queue_alloc(&new_queue, size, pqueue->pages[0], pqueue->buf != NULL);
+    if (ret < 0)
+        goto unlock;
+
+    // Stored data keeps its free running indexes, only the masking changes
+    for (pos = tail; pos != head; pos += chunk) {
+        offset = pos & (pqueue->capacity - 1);
+        chunk = min_t(size_t, head - pos, pqueue->capacity - offset);
+        data_queue_copy_in(&new_queue, pos, pqueue->buf + offset, chunk);
+    }
+
+    // Swap the rings and free the old data pages
+    swap(pqueue->pages, new_queue.pages);
+    swap(pqueue->nr_pages, new_queue.nr_pages);
+    swap(pqueue->buf, new_queue.buf);
+    swap(pqueue->capacity, new_queue.capacity);
+    data_queue_free(&new_queue, true);
+    WRITE_ONCE(pqueue->limit, size);
+    pqueue->phdr->capacity = pqueue->capacity;
+    pqueue->phdr->limit = pqueue->limit;
+    // Publish the possibly clamped head
+    smp_store_release(&pqueue->phdr->head, head);
+
+unlock:
+    mutex_unlock(&pqueue->map_mtx);
+    return ret;
+}
@@ -1,42 +1,495 @@
 #pragma once
 
-// Data queue entry type
-struct data_queue_entry {
-    // Double linked list handle
-    struct list_head entry_head;
-    // Stored byte of data
-    char data_byte;
+#include "litechr_ioctl.h"
+
+// Number of enqueue timestamps a data queue keeps for chunks not read yet (power of two)
+#define DATA_QUEUE_STAMPS           64
+// Number of log2 buckets of a latency histogram (bucket n counts latencies in [2^n, 2^(n+1)) ns)
+#define LATENCY_BUCKETS             64
+// Bytes of data pages a CPU may charge to a file context budget before its counter is folded into the shared sum
+#define FILE_CONTEXT_BUDGET_BATCH   (1024 * 1024)
+
+// Limit of the data pages allocated by all the file contexts sharing it
+struct file_context_budget {
+    // Bytes of data pages allocated (counted per CPU and folded into the shared sum in batches)
+    struct percpu_counter used;
+    // Maximum number of bytes of data pages (0 if not limited)
+    size_t limit;
+};
+
+// Enqueue timestamp of a chunk written to a data queue
+struct data_queue_stamp {
+    // Free running write index just after the chunk
+    unsigned int end;
+    // Time the chunk was stored at (ns)
+    u64 time;
+};
+
+// Data queue stored as a contiguous byte ring in separately allocated pages,
+// so that it can be mapped to user space as is.
+// The first page holds the ring header (with free running head/tail indexes), the rest hold the data.
+struct data_queue {
+    // Ring pages (header page followed by data pages)
+    struct page **pages;
+    // Number of ring pages
+    unsigned int nr_pages;
+    // Ring header (shared with user space)
+    struct litechr_ring_header *phdr;
+    // Ring data (NULL while the data pages of a lazily allocated queue are not allocated)
+    char *buf;
+    // Budget the data pages are charged to (NULL if not limited)
+    struct file_context_budget *pbudget;
+    // Size of the ring data in bytes (power of two)
+    size_t capacity;
+    // Maximum number of bytes the queue may hold (not above capacity)
+    size_t limit;
+    // Number of user space mappings of the ring
+    atomic_t mmap_count;
+    // Mutex serializing mappings of the ring with replacing or freeing its pages, taken inside the queue mutexes
+    // (and inside mmap_lock by mmap) and never held across user copies
+    struct mutex map_mtx;
+    // Mutex to be used for blocking simultaneous queue access
+    struct mutex mtx;
+    // Set when the queue has one opener only, so readers and writers do not need to exclude each other
+    // (they are synchronized by the acquire/release ring indexes) and take only their own side mutex
+    bool spsc;
+    // Mutex serializing readers of a single opener queue
+    struct mutex rd_mtx;
+    // Mutex serializing writers of a single opener queue
+    struct mutex wr_mtx;
+    // Readers waiting for data
+    wait_queue_head_t rd_wq;
+    // Writers waiting for free space
+    wait_queue_head_t wr_wq;
+    // Enqueue timestamps of the stored chunks (NULL if latency is not measured)
+    struct data_queue_stamp *pstamps;
+    // Free running index of the next timestamp, changed by writers
+    unsigned int stamps_head;
+    // Free running index of the oldest timestamp, changed by readers
+    unsigned int stamps_tail;
+    // Number of chunks not timestamped because all the timestamps were in use
+    unsigned long stamps_dropped;
+};
+
+// Header of a data chunk in a strictly ordered sharded file context
+struct shard_chunk_header {
+    // Global sequence number of the write the chunk is stored by
+    u64 seq;
+    // Number of data bytes following the header
+    u32 length;
+} __packed;
+
+#define SHARD_CHUNK_HEADER_SIZE     sizeof(struct shard_chunk_header)
+
+// File context counters (kept per CPU, so that counting does not make the context cache lines bounce)
+struct file_context_stats {
+    // Number of bytes read
+    u64 read_bytes;
+    // Number of reads that returned data
+    u64 reads;
+    // Number of bytes written
+    u64 write_bytes;
+    // Number of writes that stored data
+    u64 writes;
+    // Number of times a reader or writer found the queue locked by another one
+    u64 lock_contended;
 };
 
-// File context list entry
+// Enqueue to dequeue latency histogram of a file context (changed by readers only)
+struct file_context_latency {
+    // Number of chunks read per log2 bucket of their latency
+    u64 buckets[LATENCY_BUCKETS];
+};
+
+// Read position of a file in a broadcast mode file context
+struct file_context_cursor {
+    // Entry of the context cursor list (empty until the file reads the context in broadcast mode)
+    struct list_head node;
+    // Free running index of the next byte to read
+    unsigned int pos;
+    // Set when bytes the file has not read yet were dropped
+    bool overrun;
+};
+
+// File context (registry entry for multi mode contexts)
 struct file_context {
-    // Fields related to data queue	
-    struct {	
-        // Head of the queue (with entries of type data_queue_entry)
-        struct list_head head;
-        // Pointer to the tail of the queue (points to the head if the queue is empty)	
-        struct list_head *ptail;
-        // Size of the queue	
-        size_t size;
-        // Mutex to be used for blocking simultaneous queue access	
-        struct mutex mtx;
-    } data_queue;	
-    // Double linked list handle
-    struct list_head ctx_head;
-};
-
-// Initialize file context
-void file_context_init(struct file_context *pfile_ctx);
-// Add new file context to the list and return its pointer
-struct file_context* file_context_add(struct file_context *pmain_file_ctx);
+    // Context flags (LITECHR_CTX_*), changed only while the whole data queue is locked
+    unsigned int flags;
+    // Fields related to data queue
+    // (for a sharded context only the reader mutex and wait queues of it are used)
+    struct data_queue data_queue;
+    // Fields related to per CPU sub-queues of a sharded context
+    struct {
+        // Sub-queues indexed by CPU number (NULL if the context is not sharded)
+        struct data_queue *queues;
+        // Number of sub-queues
+        unsigned int count;
+        // Writes are stored as chunks with sequence numbers and read in the order of them
+        bool strict_order;
+        // Sequence number of the next written chunk
+        atomic64_t seq;
+        // Sequence number of the next chunk to read
+        u64 next_seq;
+        // Sub-queue the next round robin read starts with
+        unsigned int next;
+        // Sub-queue holding the chunk being read
+        struct data_queue *pcur;
+        // Number of bytes left in the chunk being read
+        size_t cur_left;
+    } shards;
+    // Index of the context in the registry (0 for the static shared context which is not registered)
+    u32 id;
+    // Channel number the context is registered for and the number of files attached to it
+    // (only used by channel contexts of the driver, changed under its channel registry mutex)
+    u32 channel;
+    unsigned int users;
+    // Counters
+    struct file_context_stats __percpu *pstats;
+    // Largest number of bytes stored in the data queue (in a single sub-queue of a sharded context)
+    size_t max_size;
+    // Latency histogram (NULL if latency is not measured)
+    struct file_context_latency *platency;
+    // Bytes at the head of the data queue borrowed by a reader until it commits them (set while locked for reading)
+    struct {
+        // Opened file holding the lease (NULL if there is no lease)
+        const void *powner;
+        // Free running index of the first leased byte (of the record header in record mode)
+        unsigned int pos;
+        // Number of leased bytes (including the record header in record mode)
+        size_t length;
+    } lease;
+    // Cursors of the files reading the context in broadcast mode (changed while the data queue mutex is locked)
+    struct list_head cursors;
+    // Data pages of the data queue allocated by the first write and freed again while the queue is idle
+    struct {
+        // Time the queue has to stay empty without writes before its data pages are freed (0 if they are kept)
+        unsigned long idle;
+        // Write index seen by the previous idle check
+        unsigned int head;
+        // Idle check, queued while the data pages are allocated
+        struct delayed_work work;
+    } storage;
+};
+
+// Slab cache and recycle pool of dynamically added file contexts
+struct file_context_pool {
+    // Slab cache the contexts are allocated from
+    struct kmem_cache *cache;
+    // Data queue size of the contexts (only contexts of this size are recycled)
+    size_t size;
+    // Lock protecting the pooled entries and statistics
+    spinlock_t lock;
+    // Released contexts kept along with their ring (without the data pages)
+    struct file_context **entries;
+    // Number of pooled contexts
+    unsigned int count;
+    // Maximum number of pooled contexts
+    unsigned int max_count;
+    // Number of contexts taken from the pool
+    unsigned long hits;
+    // Number of contexts allocated because the pool was empty
+    unsigned long misses;
+    // Number of released contexts freed because the pool was full or they did not fit it
+    unsigned long drops;
+    // Counters of the removed contexts
+    struct file_context_stats removed_stats;
+    // Measure latency of the contexts
+    bool latency;
+    // Idle time after which the data pages of the contexts are freed in milliseconds (0 if they are kept)
+    unsigned int idle_ms;
+    // Budget the data pages of the contexts are charged to (NULL if not limited)
+    struct file_context_budget *pbudget;
+    // Number of pooled contexts freed under memory pressure
+    unsigned long shrunk;
+    // Shrinker freeing pooled contexts under memory pressure
+    struct shrinker shrinker;
+};
+
+// Number of bytes stored in the data queue
+static inline size_t data_queue_size(const struct data_queue *pqueue)
+{
+    // A queue without data pages is empty, even if its indexes were changed through a mapping of the header
+    if (READ_ONCE(pqueue->buf) == NULL)
+        return 0;
+    // The indexes may be changed by user space at any time, so never trust them beyond the limit
+    return min_t(size_t, READ_ONCE(pqueue->phdr->head) - READ_ONCE(pqueue->phdr->tail), READ_ONCE(pqueue->limit));
+}
+
+// Number of bytes that can still be written to the data queue
+static inline size_t data_queue_space(const struct data_queue *pqueue)
+{
+    size_t limit = READ_ONCE(pqueue->limit);
+
+    return limit - min_t(size_t, READ_ONCE(pqueue->phdr->head) - READ_ONCE(pqueue->phdr->tail), limit);
+}
+
+// Lock a data queue mutex, only trying to if the caller must not sleep
+// The per CPU counter is incremented when the mutex is found taken
+// Returns 0, -EAGAIN if the mutex is busy or -EINTR if interrupted
+static inline int data_queue_mutex_lock(struct mutex *pmtx, bool nowait, u64 __percpu *pcontended)
+{
+    if (mutex_trylock(pmtx))
+        return 0;
+    this_cpu_inc(*pcontended);
+    if (nowait)
+        return -EAGAIN;
+    return mutex_lock_interruptible(pmtx);
+}
+
+// Lock the data queue for reading
+static inline int data_queue_lock_reader(struct data_queue *pqueue, bool nowait, u64 __percpu *pcontended)
+{
+    return data_queue_mutex_lock(pqueue->spsc ? &pqueue->rd_mtx : &pqueue->mtx, nowait, pcontended);
+}
+
+// Unlock the data queue locked for reading
+static inline void data_queue_unlock_reader(struct data_queue *pqueue)
+{
+    mutex_unlock(pqueue->spsc ? &pqueue->rd_mtx : &pqueue->mtx);
+}
+
+// Lock the data queue for writing
+static inline int data_queue_lock_writer(struct data_queue *pqueue, bool nowait, u64 __percpu *pcontended)
+{
+    return data_queue_mutex_lock(pqueue->spsc ? &pqueue->wr_mtx : &pqueue->mtx, nowait, pcontended);
+}
+
+// Unlock the data queue locked for writing
+static inline void data_queue_unlock_writer(struct data_queue *pqueue)
+{
+    mutex_unlock(pqueue->spsc ? &pqueue->wr_mtx : &pqueue->mtx);
+}
+
+// Lock the whole data queue (excluding both readers and writers in any mode)
+static inline int data_queue_lock(struct data_queue *pqueue)
+{
+    if (mutex_lock_interruptible(&pqueue->mtx))
+        return -EINTR;
+    if (mutex_lock_interruptible(&pqueue->wr_mtx)) {
+        mutex_unlock(&pqueue->mtx);
+        return -EINTR;
+    }
+    if (mutex_lock_interruptible(&pqueue->rd_mtx)) {
+        mutex_unlock(&pqueue->wr_mtx);
+        mutex_unlock(&pqueue->mtx);
+        return -EINTR;
+    }
+    return 0;
+}
+
+// Unlock the whole data queue
+static inline void data_queue_unlock(struct data_queue *pqueue)
+{
+    mutex_unlock(&pqueue->rd_mtx);
+    mutex_unlock(&pqueue->wr_mtx);
+    mutex_unlock(&pqueue->mtx);
+}
+
+// Get the sub-queue of the current CPU
+static inline struct data_queue* file_context_shard_get(struct file_context *pfile_ctx)
+{
+    // The task may migrate afterwards, the sub-queue is still locked before use
+    return &pfile_ctx->shards.queues[raw_smp_processor_id()];
+}
+
+// Number of bytes stored along with the data of every write to the file context
+static inline size_t file_context_write_overhead(struct file_context *pfile_ctx)
+{
+    // Every chunk of a strictly ordered context and every record carries a header
+    if (pfile_ctx->shards.strict_order)
+        return SHARD_CHUNK_HEADER_SIZE;
+    if (READ_ONCE(pfile_ctx->flags) & LITECHR_CTX_RECORDS)
+        return LITECHR_RECORD_HEADER_SIZE;
+    return 0;
+}
+
+// Number of data bytes a write can store in a data queue of the file context (can be used without locking)
+static inline size_t file_context_queue_space(struct file_context *pfile_ctx, struct data_queue *pqueue)
+{
+    size_t space = data_queue_space(pqueue);
+    size_t overhead = file_context_write_overhead(pfile_ctx);
+
+    return space > overhead ? space - overhead : 0;
+}
+
+// Number of data bytes a write to the file context could store right now (can be used without locking)
+static inline size_t file_context_space(struct file_context *pfile_ctx)
+{
+    if (pfile_ctx->shards.count)
+        return file_context_queue_space(pfile_ctx, file_context_shard_get(pfile_ctx));
+    return file_context_queue_space(pfile_ctx, &pfile_ctx->data_queue);
+}
+
+// Check if bytes at the head of the file context are leased to a reader (can be used without locking)
+// A lease also ends when the tail index is moved through the mapping
+static inline bool file_context_leased(struct file_context *pfile_ctx)
+{
+    // Acquire pairs with the release of the owner, so the position of the lease is set
+    return smp_load_acquire(&pfile_ctx->lease.powner) &&
+        READ_ONCE(pfile_ctx->data_queue.phdr->tail) == READ_ONCE(pfile_ctx->lease.pos);
+}
+
+// Check if a read at the cursor of a file would return something (can be used without locking)
+static inline bool file_context_cursor_readable(struct file_context *pfile_ctx, struct file_context_cursor *pcursor)
+{
+    // A file that has not read yet starts at the oldest stored byte
+    if (list_empty(&pcursor->node))
+        return data_queue_size(&pfile_ctx->data_queue) != 0;
+    return READ_ONCE(pcursor->overrun) || READ_ONCE(pfile_ctx->data_queue.phdr->head) != READ_ONCE(pcursor->pos);
+}
+
+// Lock the file context for reading (only trying to if the caller must not sleep)
+// Returns 0, -EAGAIN if the context is busy or -EINTR if interrupted
+static inline int file_context_lock_reader(struct file_context *pfile_ctx, bool nowait)
+{
+    // Readers of a sharded context are serialized by the context, writers only lock their sub-queues
+    if (pfile_ctx->shards.count)
+        return data_queue_mutex_lock(&pfile_ctx->data_queue.rd_mtx, nowait, &pfile_ctx->pstats->lock_contended);
+    return data_queue_lock_reader(&pfile_ctx->data_queue, nowait, &pfile_ctx->pstats->lock_contended);
+}
+
+// Unlock the file context locked for reading
+static inline void file_context_unlock_reader(struct file_context *pfile_ctx)
+{
+    if (pfile_ctx->shards.count)
+        mutex_unlock(&pfile_ctx->data_queue.rd_mtx);
+    else
+        data_queue_unlock_reader(&pfile_ctx->data_queue);
+}
+
+// Lock the data queue the next write to the file context goes to (only trying to if the caller must not sleep)
+// Returns the locked queue, ERR_PTR(-EAGAIN) if it is busy or ERR_PTR(-EINTR) if interrupted
+static inline struct data_queue* file_context_lock_writer(struct file_context *pfile_ctx, bool nowait)
+{
+    struct data_queue *pqueue;
+    int ret;
+
+    pqueue = pfile_ctx->shards.count ? file_context_shard_get(pfile_ctx) : &pfile_ctx->data_queue;
+    ret = data_queue_lock_writer(pqueue, nowait, &pfile_ctx->pstats->lock_contended);
+    if (ret)
+        return ERR_PTR(ret);
+    return pqueue;
+}
+
+// Initialize file context budget of limit bytes of data pages (0 if not limited)
+// Returns 0 or -ENOMEM
+int file_context_budget_init(struct file_context_budget *pbudget, size_t limit);
+// Destroy file context budget (all the data pages charged to it must be freed already)
+void file_context_budget_destroy(struct file_context_budget *pbudget);
+// Number of bytes of data pages charged to the file context budget
+size_t file_context_budget_used(struct file_context_budget *pbudget);
+// Initialize file context with a data queue able to hold size bytes (measuring read latency if requested)
+// With non-zero idle_ms the data pages are only allocated by the first write and freed again
+// once the queue stayed empty without writes for about idle_ms milliseconds
+// The data pages are charged to the budget if one is given
+// Returns 0, -ENOBUFS if the budget is exhausted or other negative error
+int file_context_init(struct file_context *pfile_ctx, size_t size, bool latency, unsigned int idle_ms,
+    struct file_context_budget *pbudget);
+// Split file context data queue into per CPU sub-queues able to hold size bytes each
+// Returns 0 or negative error
+int file_context_shards_init(struct file_context *pfile_ctx, size_t size, bool strict_order);
+// Create file context cache with a pool of up to max_count contexts able to hold size bytes
+// (measuring read latency if requested and freeing the data pages of idle contexts after idle_ms milliseconds)
+// The pooled contexts are freed under memory pressure, the data pages of all contexts are charged to the budget if one is given
+// Returns 0 or negative error
+int file_context_pool_init(struct file_context_pool *ppool, size_t size, unsigned int max_count, bool latency,
+    unsigned int idle_ms, struct file_context_budget *pbudget);
+// Free pooled file contexts and destroy the cache (all added contexts must be removed already)
+void file_context_pool_destroy(struct file_context_pool *ppool);
+// Add counters of the removed file contexts to the given ones
+void file_context_pool_stats_sum(struct file_context_pool *ppool, struct file_context_stats *pstats);
+// Number of bytes of memory used by the pooled file contexts
+size_t file_context_pool_memory(struct file_context_pool *ppool);
+// Take a file context from the pool (or allocate it), register it with an index below max_count and return its pointer
+struct file_context* file_context_add(struct file_context_pool *ppool, struct xarray *pfile_ctxs, u32 max_count);
 // Empty data queue of specific file context
 void file_context_data_queue_clear(struct file_context *pfile_ctx);
-// Remove file context from the list and free it's memory (if not static)
-void file_context_remove(struct file_context *pfile_ctx);
-// Read bytes from file context's data queue to kernel buffer
+// Remove file context from the registry and return it to the pool or free it's memory (if not static)
+void file_context_remove(struct file_context_pool *ppool, struct xarray *pfile_ctxs, struct file_context *pfile_ctx);
+// Read bytes from file context's data queue to kernel buffer (the context must not be sharded or in record mode)
 // Returns number of bytes actually read
 size_t file_context_data_queue_read_to_buffer(struct file_context *pfile_ctx, char *kbuf, size_t length);
-// Write bytes as new queue entries
-// Returns number of writted bytes or negative error
-ssize_t file_context_data_queue_write_from_buffer(struct file_context *pfile_ctx, char *kbuf, size_t length);
-
+// Write bytes to the end of the data queue (the context must not be sharded or in record mode)
+// Returns number of written bytes (limited by the free space of the queue, 0 if the data pages could not be allocated)
+size_t file_context_data_queue_write_from_buffer(struct file_context *pfile_ctx, const char *kbuf, size_t length);
+// Check if a read from the file context would return some data (can be used without locking)
+bool file_context_readable(struct file_context *pfile_ctx);
+// Number of bytes the next read from the file context can return (the length of the next record in record mode)
+// For a strictly ordered sharded context only the next chunk is counted, so more bytes may be returned
+// The context must be locked for reading
+size_t file_context_read_size(struct file_context *pfile_ctx);
+// Copy bytes (or a single record in record mode) from file context's data queue to user buffer without removing them
+// The context must be locked for reading
+// Returns number of bytes copied, -EOPNOTSUPP for a sharded context, -EIO if the records are corrupted or -EFAULT
+ssize_t file_context_data_queue_peek(struct file_context *pfile_ctx, char __user *pbuf, size_t length);
+// Lease bytes (or a single record in record mode) at the head of file context's data queue to the owner,
+// copying them to user buffer (if any) and setting the free running index of the data
+// The context must be locked for reading
+// Returns number of bytes leased (0 if the queue is empty), -EBUSY if the context is leased already,
+// -EOPNOTSUPP for a sharded context, -EIO if the records are corrupted or -EFAULT
+ssize_t file_context_lease(struct file_context *pfile_ctx, const void *powner, char __user *pbuf, size_t length,
+    unsigned int *ppos);
+// Remove the first length leased bytes (the whole record in record mode if length is not 0) from the file context
+// and end the lease held by the owner, the rest of the leased bytes is returned to the queue
+// The context must be locked for reading
+// Returns 0, -EINVAL if the owner holds no lease or length exceeds it
+int file_context_lease_commit(struct file_context *pfile_ctx, const void *powner, size_t length);
+// End the lease of the file context if it is held by the owner, the leased bytes are returned to the queue
+// Can be used without locking
+// Returns true if the lease was held by the owner
+bool file_context_lease_release(struct file_context *pfile_ctx, const void *powner);
+// Start reading a broadcast mode file context at the cursor of a file (does nothing if the cursor is in use already
+// or the context is not in broadcast mode)
+// The context must be locked for reading
+void file_context_cursor_attach(struct file_context *pfile_ctx, struct file_context_cursor *pcursor);
+// Stop reading the file context at the cursor, so that the bytes not read yet do not have to be kept for it
+// Takes the data queue mutex (without being interrupted) if the cursor is in use
+void file_context_cursor_detach(struct file_context *pfile_ctx, struct file_context_cursor *pcursor);
+// Number of bytes the next read at the cursor of a file can return (the length of the next record in record mode)
+// The context must be locked for reading
+size_t file_context_cursor_read_size(struct file_context *pfile_ctx, struct file_context_cursor *pcursor);
+// Read bytes (or a single record in record mode) from broadcast mode file context at the cursor directly to I/O iterator
+// The context must be locked for reading
+// Returns number of bytes read, -EPIPE once after bytes not read at the cursor were dropped, -EIO if the records
+// are corrupted or -EFAULT if none could be copied
+ssize_t file_context_cursor_read_to_iter(struct file_context *pfile_ctx, struct file_context_cursor *pcursor, struct iov_iter *piter);
+// Drop the oldest bytes (whole records in record mode) of broadcast mode file context, so that length bytes can be written
+// The context must be locked for writing
+void file_context_broadcast_drop(struct file_context *pfile_ctx, size_t length);
+// Read bytes (or a single record in record mode) from file context's data queue directly to I/O iterator
+// Returns number of bytes read or -EFAULT if none could be copied
+ssize_t file_context_data_queue_read_to_iter(struct file_context *pfile_ctx, struct iov_iter *piter);
+// Write bytes (or a single record in record mode) from I/O iterator directly to the end of the data queue
+// locked with file_context_lock_writer
+// The data pages of an idle context are not allocated by a nowait write, which may not sleep in reclaim
+// Returns number of written bytes, -EAGAIN if the data pages are needed by a nowait write, -ENOBUFS or -ENOMEM
+// if they could not be allocated or -EFAULT if none could be copied
+ssize_t file_context_data_queue_write_from_iter(struct file_context *pfile_ctx, struct data_queue *pqueue, struct iov_iter *piter,
+    bool nowait);
+// Number of bytes stored in the file context (can be used without locking)
+size_t file_context_size(struct file_context *pfile_ctx);
+// Allocate the data pages of a lazily allocated file context if they are not allocated
+// The mapping mutex of the data queue must be held
+// Returns 0, -ENOBUFS if the file context budget is exhausted or -ENOMEM
+int file_context_storage_get(struct file_context *pfile_ctx);
+// Free the data pages of a lazily allocated file context if it is empty, not mapped and not locked by anybody
+// Can be used without locking
+// Returns true if the data pages are not allocated (any more)
+bool file_context_storage_reclaim(struct file_context *pfile_ctx);
+// Number of bytes of memory used by the file context (can be used without locking)
+size_t file_context_memory(struct file_context *pfile_ctx);
+// Add up counters of the file context from all CPUs to the given ones
+void file_context_stats_sum(struct file_context *pfile_ctx, struct file_context_stats *pstats);
+// Number of chunks of the file context that were not timestamped
+unsigned long file_context_stamps_dropped(struct file_context *pfile_ctx);
+// Reset latency histogram of the file context
+// The context must be locked for reading
+void file_context_latency_reset(struct file_context *pfile_ctx);
+// Change file context flags
+// The whole queue must be locked
+// Returns 0 or negative error
+int file_context_flags_set(struct file_context *pfile_ctx, unsigned int flags);
+// Change the number of bytes the data queue can hold keeping the stored data
+// The whole queue must be locked
+// Returns 0 or negative error
+int file_context_data_queue_resize(struct file_context *pfile_ctx, size_t size);
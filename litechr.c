@@ -7,34 +7,254 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/smp.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/ktime.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <asm/ioctls.h>
+#include <kunit/visibility.h>
 
-#include "litechr.h"
 #include "context.h"
+#include "litechr.h"
+#include "litechr_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "litechr_trace.h"
+
+// Driver open file callback
+VISIBLE_IF_KUNIT int litechr_open(struct inode *pinode, struct file *pfile);
+// Driver close file callback
+VISIBLE_IF_KUNIT int litechr_release(struct inode *pinode, struct file *pfile);
+// Driver read file callback (also used for vectored and asynchronous reads)
+static ssize_t litechr_read_iter(struct kiocb *piocb, struct iov_iter *pto);
+// Driver write file callback (also used for vectored and asynchronous writes)
+static ssize_t litechr_write_iter(struct kiocb *piocb, struct iov_iter *pfrom);
+// Driver splice from pipe callback
+static ssize_t litechr_splice_write(struct pipe_inode_info *ppipe, struct file *pfile, loff_t *ppos, size_t length, unsigned int flags);
+// Driver poll file callback
+static __poll_t litechr_poll(struct file *pfile, struct poll_table_struct *pwait);
+// Driver mmap callback
+static int litechr_mmap(struct file *pfile, struct vm_area_struct *pvma);
+// Open a file using the context of the numbered channel, creating the channel if it does not exist
+static int litechr_channel_open(u32 channel, struct file *pfile);
+// Driver ioctl callback
+static long litechr_ioctl(struct file *pfile, unsigned int cmd, unsigned long arg);
+
+// Show file context pool statistics in debugfs
+static int litechr_context_pool_show(struct seq_file *pseq, void *pdata);
+// Show driver statistics in debugfs
+static int litechr_stats_show(struct seq_file *pseq, void *pdata);
+// Show statistics of every file context in debugfs
+static int litechr_contexts_show(struct seq_file *pseq, void *pdata);
+// Show latency histograms of every file context in debugfs
+static int litechr_latency_show(struct seq_file *pseq, void *pdata);
+
+// Set access rights for the device file
+static int litechr_uevent(struct device *pdev, struct kobj_uevent_env *penv);
 
 #define DEVICE_NAME         "litechr"
-// Maximum size of data queue
-#define MAX_BUFFER_SIZE     1000
+// Upper bound for data queue size (ring indexes are 32-bit)
+#define BUFFER_SIZE_LIMIT   (1u << 30)
+
+// Default size of data queue
+static unsigned int litechr_buffer_size = 1000;
+module_param_named(buffer_size, litechr_buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Default data queue size of a file context in bytes (default 1000)");
+
+// Maximum size of data queue that can be set for a file context with ioctl
+static unsigned int litechr_max_buffer_size = 16 << 20;
+module_param_named(max_buffer_size, litechr_max_buffer_size, uint, 0444);
+MODULE_PARM_DESC(max_buffer_size, "Maximum data queue size of a file context in bytes (default 16 MiB)");
+
 // Limit of simultaneously opened files
-#define MAX_OPENED_FILES    1000
-// Limit of file contexts used for multiple contexts mode
-#define MAX_FILE_CONTEXTS   1001
+VISIBLE_IF_KUNIT unsigned int litechr_max_opened_files = 1000;
+EXPORT_SYMBOL_IF_KUNIT(litechr_max_opened_files);
+module_param_named(max_opened_files, litechr_max_opened_files, uint, 0444);
+MODULE_PARM_DESC(max_opened_files, "Limit of simultaneously opened files (default 1000)");
+
+// Limit of file contexts used for multiple contexts mode (including the shared one)
+VISIBLE_IF_KUNIT unsigned int litechr_max_file_contexts = 1001;
+EXPORT_SYMBOL_IF_KUNIT(litechr_max_file_contexts);
+module_param_named(max_file_contexts, litechr_max_file_contexts, uint, 0444);
+MODULE_PARM_DESC(max_file_contexts, "Limit of file contexts including the shared one (default 1001)");
+
+// Split the shared context into per CPU sub-queues
+static bool litechr_shared_sharded;
+module_param_named(shared_sharded, litechr_shared_sharded, bool, 0444);
+MODULE_PARM_DESC(shared_sharded, "Use per CPU sub-queues of buffer_size bytes each for the shared context (default off)");
+
+// Keep the order of writes to the sharded shared context
+static bool litechr_shared_strict_order;
+module_param_named(shared_strict_order, litechr_shared_strict_order, bool, 0444);
+MODULE_PARM_DESC(shared_strict_order, "Read the sharded shared context in the global order of writes instead of round robin (default off)");
+
+// Number of released multi mode contexts kept for reuse
+static unsigned int litechr_context_pool_size = 64;
+module_param_named(context_pool_size, litechr_context_pool_size, uint, 0444);
+MODULE_PARM_DESC(context_pool_size, "Number of released multi mode file contexts kept for reuse (default 64)");
+
+// Idle time after which the data pages of multi mode and channel contexts are freed
+static unsigned int litechr_storage_idle_ms = 1000;
+module_param_named(storage_idle_ms, litechr_storage_idle_ms, uint, 0444);
+MODULE_PARM_DESC(storage_idle_ms, "Allocate data queue storage of multi mode and channel contexts on the first write and free it "
+    "once the queue stayed empty without writes for so many milliseconds (0 keeps it allocated, default 1000)");
+
+// Limit of the data pages of all file contexts together
+static unsigned long litechr_storage_budget;
+module_param_named(storage_budget, litechr_storage_budget, ulong, 0444);
+MODULE_PARM_DESC(storage_budget, "Limit of the data queue storage of all file contexts together in bytes, writes needing more "
+    "are rejected with ENOBUFS (0 for no limit, default 0)");
+
+// Timestamp written chunks and keep enqueue to dequeue latency histograms of file contexts
+static bool litechr_latency_histograms;
+module_param_named(latency_histograms, litechr_latency_histograms, bool, 0444);
+MODULE_PARM_DESC(latency_histograms, "Measure enqueue to dequeue latency of file contexts (default off)");
 
 static dev_t litechr_dev;
 static struct cdev litechr_cdev;
 static struct class *plitechr_class;
 
-// Number of opened files
-static unsigned int litechr_opened_files_count;
+// Number of opened files (or OPENED_FILES_EXCLUSIVE), changed with atomic compare and exchange,
+// so that open/close never take a global lock
+VISIBLE_IF_KUNIT atomic_t litechr_opened_files_count = ATOMIC_INIT(0);
+EXPORT_SYMBOL_IF_KUNIT(litechr_opened_files_count);
+
+// The static entry is used for shared/exclusive file data queue.
+VISIBLE_IF_KUNIT struct file_context litechr_file_context;
+EXPORT_SYMBOL_IF_KUNIT(litechr_file_context);
+// The registry of file contexts added dynamically to be used for separate file data queues
+VISIBLE_IF_KUNIT DEFINE_XARRAY_ALLOC(litechr_file_contexts);
+EXPORT_SYMBOL_IF_KUNIT(litechr_file_contexts);
+// The registry of channel contexts indexed by channel number (the contexts are in the file contexts registry as well)
+VISIBLE_IF_KUNIT DEFINE_XARRAY(litechr_channels);
+EXPORT_SYMBOL_IF_KUNIT(litechr_channels);
+// Mutex serializing creation and removal of channels with attaching files to them
+static DEFINE_MUTEX(litechr_channels_mtx);
+// The cache and recycle pool of dynamically added file contexts
+static struct file_context_pool litechr_file_context_pool;
+// The budget the data pages of all file contexts are charged to
+static struct file_context_budget litechr_file_context_budget;
+// The cache of opened file states
+static struct kmem_cache *plitechr_opened_file_cache;
 
-// Open/close operations mutex
-static struct mutex litechr_openclose_mtx;
+// Driver debugfs directory
+static struct dentry *plitechr_debugfs_dir;
+// Driver counters
+static DEFINE_PER_CPU(struct litechr_stats, litechr_stats);
 
-// The list head entry is used for shared/exclusive file data queue.
-// The new entries are added dynamically to be used for separate file data queues.
-static struct file_context litechr_file_context;
-static unsigned int litechr_file_contexts_count;
+// Current time for measuring lock waits, only taken while the tracepoint is enabled
+static inline u64 litechr_trace_clock(bool tracing)
+{
+    return tracing ? ktime_get_ns() : 0;
+}
 
-static bool litechr_exclusive_mode;
+// Count a request rejected with the error (other errors are not counted)
+static inline void litechr_stats_rejected(int err)
+{
+    switch (err) {
+    case -ENOBUFS:
+        this_cpu_inc(litechr_stats.rejected_enobufs);
+        break;
+    case -EBUSY:
+        this_cpu_inc(litechr_stats.rejected_ebusy);
+        break;
+    case -EMFILE:
+        this_cpu_inc(litechr_stats.rejected_emfile);
+        break;
+    }
+}
+
+// Count a newly opened file unless the device is in exclusive mode or the opened files limit is reached
+static int litechr_opened_files_inc(void)
+{
+    int count = atomic_read(&litechr_opened_files_count);
+
+    do {
+        // Check for exclusive mode on
+        if (count == OPENED_FILES_EXCLUSIVE) {
+            pr_err("The device is already in exclusive mode\n");
+            return -EBUSY;
+        }
+        // Test open files limit
+        if ((unsigned int)count >= litechr_max_opened_files) {
+            pr_err("Maximum opened files count reached\n");
+            return -EMFILE;
+        }
+    } while (!atomic_try_cmpxchg(&litechr_opened_files_count, &count, count + 1));
+    return 0;
+}
+
+// Get the context of the numbered channel for a new file, creating the channel if it does not exist
+VISIBLE_IF_KUNIT struct file_context* litechr_channel_get(u32 channel)
+{
+    struct file_context *pfile_ctx;
+    int ret;
+
+    mutex_lock(&litechr_channels_mtx);
+    pfile_ctx = xa_load(&litechr_channels, channel);
+    if (pfile_ctx) {
+        pfile_ctx->users++;
+        goto out;
+    }
+    // Channels are limited by the file contexts registry like multi mode contexts
+    pfile_ctx = file_context_add(&litechr_file_context_pool, &litechr_file_contexts, litechr_max_file_contexts);
+    if (IS_ERR(pfile_ctx))
+        goto out;
+    pfile_ctx->channel = channel;
+    pfile_ctx->users = 1;
+    ret = xa_insert(&litechr_channels, channel, pfile_ctx, GFP_KERNEL);
+    if (ret < 0) {
+        file_context_remove(&litechr_file_context_pool, &litechr_file_contexts, pfile_ctx);
+        pfile_ctx = ERR_PTR(ret);
+    }
+out:
+    mutex_unlock(&litechr_channels_mtx);
+    return pfile_ctx;
+}
+EXPORT_SYMBOL_IF_KUNIT(litechr_channel_get);
+
+// Drop the reference of a closed file to the channel context, removing the channel with the last one
+VISIBLE_IF_KUNIT void litechr_channel_put(struct file_context *pfile_ctx)
+{
+    mutex_lock(&litechr_channels_mtx);
+    if (--pfile_ctx->users == 0) {
+        xa_erase(&litechr_channels, pfile_ctx->channel);
+        file_context_remove(&litechr_file_context_pool, &litechr_file_contexts, pfile_ctx);
+    }
+    mutex_unlock(&litechr_channels_mtx);
+}
+EXPORT_SYMBOL_IF_KUNIT(litechr_channel_put);
+
+// Check if a read from the file would return some data (can be used without locking)
+static inline bool litechr_file_readable(struct opened_file *popened_file)
+{
+    if (READ_ONCE(popened_file->pfile_ctx->flags) & LITECHR_CTX_BROADCAST)
+        return file_context_cursor_readable(popened_file->pfile_ctx, &popened_file->cursor);
+    return file_context_readable(popened_file->pfile_ctx);
+}
+
+// Return the bytes leased by the file to its context queue
+static inline void litechr_file_context_lease_release(struct opened_file *popened_file)
+{
+    if (file_context_lease_release(popened_file->pfile_ctx, popened_file))
+        wake_up_interruptible(&popened_file->pfile_ctx->data_queue.rd_wq);
+}
 
 
 // The main driver's file operations structure
@@ -42,16 +262,33 @@ static struct file_operations litechr_fops = {
     .owner = THIS_MODULE,
     .open = litechr_open,
     .release = litechr_release,
-    .read = litechr_read,
-    .write = litechr_write,
+    .read_iter = litechr_read_iter,
+    .write_iter = litechr_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = litechr_splice_write,
+    .poll = litechr_poll,
+    .mmap = litechr_mmap,
+    .unlocked_ioctl = litechr_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
+DEFINE_SHOW_ATTRIBUTE(litechr_context_pool);
+DEFINE_SHOW_ATTRIBUTE(litechr_stats);
+DEFINE_SHOW_ATTRIBUTE(litechr_contexts);
+DEFINE_SHOW_ATTRIBUTE(litechr_latency);
+
 // Initialize the driver
 static int __init litechr_init(void)
 {
     int ret;
     struct device *pdevice_pcd;
 
+    if (litechr_max_buffer_size == 0 || litechr_max_buffer_size > BUFFER_SIZE_LIMIT ||
+        litechr_buffer_size == 0 || litechr_buffer_size > litechr_max_buffer_size) {
+        pr_err("Invalid data queue size parameters\n");
+        return -EINVAL;
+    }
+
     // Allocate device number with a single minor number
     if ((ret = alloc_chrdev_region(&litechr_dev, 0, 1, DEVICE_NAME)) < 0) {
         pr_err("Failed to allocate device number\n");
@@ -88,20 +325,59 @@ static int __init litechr_init(void)
 	    goto un_add;
     }
 
-    file_context_init(&litechr_file_context);
+    // Opened file states are charged to the memory cgroup of the opener like the file contexts
+    plitechr_opened_file_cache = KMEM_CACHE(opened_file, SLAB_ACCOUNT);
+    if (plitechr_opened_file_cache == NULL) {
+        pr_err("Failed to create opened file cache\n");
+        ret = -ENOMEM;
+        goto un_device;
+    }
 
-    litechr_file_contexts_count = 1;
+    if ((ret = file_context_budget_init(&litechr_file_context_budget, litechr_storage_budget)) < 0) {
+        pr_err("Failed to initialize storage budget\n");
+        goto un_opened_file_cache;
+    }
+
+    if ((ret = file_context_pool_init(&litechr_file_context_pool, litechr_buffer_size, litechr_context_pool_size,
+        litechr_latency_histograms, litechr_storage_idle_ms, &litechr_file_context_budget)) < 0) {
+        pr_err("Failed to create file context pool\n");
+        goto un_budget;
+    }
+
+    // The shared context is expected to be used all the time, so it keeps its storage (charged to the budget as well)
+    if ((ret = file_context_init(&litechr_file_context, litechr_buffer_size, litechr_latency_histograms, 0,
+        &litechr_file_context_budget)) < 0) {
+        pr_err("Failed to initialize shared file context\n");
+        goto un_pool;
+    }
+
+    if (litechr_shared_sharded &&
+        (ret = file_context_shards_init(&litechr_file_context, litechr_buffer_size, litechr_shared_strict_order)) < 0) {
+        pr_err("Failed to split shared file context\n");
+        file_context_remove(NULL, NULL, &litechr_file_context);
+        goto un_pool;
+    }
+
+    // Statistics are optional, so debugfs failures are not fatal
+    plitechr_debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("context_pool", 0444, plitechr_debugfs_dir, NULL, &litechr_context_pool_fops);
+    debugfs_create_file("stats", 0444, plitechr_debugfs_dir, NULL, &litechr_stats_fops);
+    debugfs_create_file("contexts", 0444, plitechr_debugfs_dir, NULL, &litechr_contexts_fops);
+    if (litechr_latency_histograms)
+        debugfs_create_file("latency", 0444, plitechr_debugfs_dir, NULL, &litechr_latency_fops);
 
-    mutex_init(&litechr_openclose_mtx);
-    
-    litechr_opened_files_count = 0;
-    
-    litechr_exclusive_mode = false;
-    
     pr_info("Linux Character Driver successfully initialized\n");
 
     return 0;
 
+un_pool:
+    file_context_pool_destroy(&litechr_file_context_pool);
+un_budget:
+    file_context_budget_destroy(&litechr_file_context_budget);
+un_opened_file_cache:
+    kmem_cache_destroy(plitechr_opened_file_cache);
+un_device:
+    device_destroy(plitechr_class, litechr_dev);
 un_add:
     // Delete character device
     cdev_del(&litechr_cdev);
@@ -117,14 +393,23 @@ un_reg:
 // Deinitialize driver
 static void __exit litechr_exit(void)
 {
-    struct file_context *pfile_ctx, *ptmp_file_ctx;
+    struct file_context *pfile_ctx;
+    unsigned long id;
+
+    debugfs_remove_recursive(plitechr_debugfs_dir);
 
-    // Clear shared file context
-    file_context_data_queue_clear(&litechr_file_context);
-    // Remove file contexts from list
-    list_for_each_entry_safe(pfile_ctx, ptmp_file_ctx, &litechr_file_context.ctx_head, ctx_head) {
-        file_context_remove(pfile_ctx);
+    // Remove file contexts from the registry
+    xa_for_each(&litechr_file_contexts, id, pfile_ctx) {
+        file_context_remove(&litechr_file_context_pool, &litechr_file_contexts, pfile_ctx);
     }
+    xa_destroy(&litechr_file_contexts);
+    // Channel contexts were removed with the rest of the registry
+    xa_destroy(&litechr_channels);
+    // Free shared file context storage (the static context itself is kept)
+    file_context_remove(NULL, NULL, &litechr_file_context);
+    file_context_pool_destroy(&litechr_file_context_pool);
+    file_context_budget_destroy(&litechr_file_context_budget);
+    kmem_cache_destroy(plitechr_opened_file_cache);
 
     device_destroy(plitechr_class, litechr_dev);
  
@@ -142,195 +427,595 @@ static void __exit litechr_exit(void)
 }
 
 // Driver open file callback
-static int litechr_open(struct inode *pinode, struct file *pfile)
+VISIBLE_IF_KUNIT int litechr_open(struct inode *pinode, struct file *pfile)
 {
     struct file_context* pnew_file_ctx;
-    
-    if (mutex_lock_interruptible(&litechr_openclose_mtx))
-        return -EINTR;
-    
-    // Test open files limit
-    if (litechr_opened_files_count >= MAX_OPENED_FILES) {
-        pr_err("Maximum opened files count reached\n");
-        mutex_unlock(&litechr_openclose_mtx);
-        return -EMFILE;   
-    }
+    struct opened_file *popened_file;
+    int ret;
 
-    // Check for exclusive mode on
-    if (litechr_opened_files_count > 0 && litechr_exclusive_mode) {
-        pr_err("The device is already in exclusive mode\n");
-        mutex_unlock(&litechr_openclose_mtx);
-        return -EBUSY;
-    }
+    popened_file = kmem_cache_zalloc(plitechr_opened_file_cache, GFP_KERNEL);
+    if (popened_file == NULL)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&popened_file->cursor.node);
+
+    // Reads and writes honor IOCB_NOWAIT, so io_uring can complete them inline
+    pfile->f_mode |= FMODE_NOWAIT;
 
     // Simultaneous O_CREAT and O_EXCL is not allowed - os controlled
 
     // Treat O_EXCL flag as the file being opened in exclusive mode
     if (pfile->f_flags & O_EXCL) {
         //pr_info("Opening with exclusive mode flag\n");
-        // Check for exclusive mode on
-        if (litechr_opened_files_count > 0) {
+        // Test open files limit
+        if (litechr_max_opened_files == 0) {
+            pr_err("Maximum opened files count reached\n");
+            ret = -EMFILE;
+            goto err_free;
+        }
+        // Exclusive mode can only be entered when there are no opened files at all
+        if (atomic_cmpxchg(&litechr_opened_files_count, 0, OPENED_FILES_EXCLUSIVE) != 0) {
             pr_err("The device is busy\n");
-            mutex_unlock(&litechr_openclose_mtx);
-            return -EBUSY;
+            ret = -EBUSY;
+            goto err_free;
         }
-        litechr_opened_files_count++;
-        
-        litechr_exclusive_mode = true;
-        mutex_unlock(&litechr_openclose_mtx);
+        // Nobody else can reach the shared context until the file is closed
+        // (broadcast mode writers may drop data under the reader, so they have to exclude each other)
+        litechr_file_context.data_queue.spsc = !(litechr_file_context.flags & LITECHR_CTX_BROADCAST);
+        popened_file->pfile_ctx = &litechr_file_context;
+        popened_file->mode = OPENED_FILE_EXCLUSIVE;
+        pfile->private_data = popened_file;
+        this_cpu_inc(litechr_stats.opens[OPENED_FILE_EXCLUSIVE]);
+        trace_litechr_open(popened_file->pfile_ctx->id, popened_file->mode, 0);
         return 0;
     }
+
+    if ((ret = litechr_opened_files_inc()) < 0)
+        goto err_free;
+
     // Treat O_CREAT flag as the file being opened in multi context mode
     if (pfile->f_flags & O_CREAT) {
         //pr_info("Opening with create flag (multi context mode)\n");
-        
-        if (litechr_file_contexts_count >= MAX_FILE_CONTEXTS) {
-            pr_err("Reached maximum file contexts count\n");
-            mutex_unlock(&litechr_openclose_mtx);
-            return -EBUSY;   
-        }
-        
-        pnew_file_ctx = file_context_add(&litechr_file_context);
+
+        // The registry limits the number of contexts (the shared one takes index 0)
+        pnew_file_ctx = file_context_add(&litechr_file_context_pool, &litechr_file_contexts, litechr_max_file_contexts);
         if (IS_ERR(pnew_file_ctx)) {
-            pr_err("Failed to add a new file context\n");
-            mutex_unlock(&litechr_openclose_mtx);
-            return PTR_ERR(pnew_file_ctx);
+            ret = PTR_ERR(pnew_file_ctx);
+            if (ret == -EBUSY)
+                pr_err("Reached maximum file contexts count\n");
+            else
+                pr_err("Failed to add a new file context\n");
+            goto err_put;
         }
-        pfile->private_data = pnew_file_ctx;
-        litechr_file_contexts_count++;
-        
-        litechr_opened_files_count++;
-        mutex_unlock(&litechr_openclose_mtx);
+        // The new context is reachable only through this file
+        pnew_file_ctx->data_queue.spsc = true;
+
+        popened_file->pfile_ctx = pnew_file_ctx;
+        popened_file->mode = OPENED_FILE_MULTI;
+        pfile->private_data = popened_file;
+        this_cpu_inc(litechr_stats.opens[OPENED_FILE_MULTI]);
+        trace_litechr_open(popened_file->pfile_ctx->id, popened_file->mode, 0);
         return 0;
     }
     // If the file is opened with neither O_CREAT nor O_EXCL flag consider it being opened in shared mode
     //pr_info("Opening with no flags (shared mode)\n");
-    litechr_opened_files_count++;
-    mutex_unlock(&litechr_openclose_mtx);
+    popened_file->pfile_ctx = &litechr_file_context;
+    popened_file->mode = OPENED_FILE_SHARED;
+    pfile->private_data = popened_file;
+    this_cpu_inc(litechr_stats.opens[OPENED_FILE_SHARED]);
+    trace_litechr_open(popened_file->pfile_ctx->id, popened_file->mode, 0);
     return 0;
+
+err_put:
+    atomic_dec(&litechr_opened_files_count);
+err_free:
+    kmem_cache_free(plitechr_opened_file_cache, popened_file);
+    litechr_stats_rejected(ret);
+    trace_litechr_open(0, (pfile->f_flags & O_EXCL) ? OPENED_FILE_EXCLUSIVE :
+        (pfile->f_flags & O_CREAT) ? OPENED_FILE_MULTI : OPENED_FILE_SHARED, ret);
+    return ret;
 }
+EXPORT_SYMBOL_IF_KUNIT(litechr_open);
 
 // Driver close file callback
-static int litechr_release(struct inode *pinode, struct file *pfile)
+VISIBLE_IF_KUNIT int litechr_release(struct inode *pinode, struct file *pfile)
 {
-    if (mutex_lock_interruptible(&litechr_openclose_mtx))
-        return -EINTR;
+    struct opened_file *popened_file = pfile->private_data;
 
-    // If the file was opened in multi context mode, destroy it's context
-    if (pfile->private_data) {
-        file_context_remove(pfile->private_data);
-        litechr_file_contexts_count--;
-        pfile->private_data = NULL;
+    this_cpu_inc(litechr_stats.closes[popened_file->mode]);
+    trace_litechr_release(popened_file->pfile_ctx->id, popened_file->mode);
+
+    // Bytes leased and not committed are returned to the queue for other readers
+    litechr_file_context_lease_release(popened_file);
+    // Bytes kept for the file in broadcast mode are released for writers
+    if (!list_empty(&popened_file->cursor.node)) {
+        file_context_cursor_detach(popened_file->pfile_ctx, &popened_file->cursor);
+        wake_up_interruptible(&popened_file->pfile_ctx->data_queue.wr_wq);
     }
-    
-    litechr_opened_files_count--;
 
-    // If no more opened files, clear driver mode
-    if (!litechr_opened_files_count) {
-        litechr_exclusive_mode = false;
+    // If the file was opened in multi context mode, destroy it's context
+    if (popened_file->mode == OPENED_FILE_MULTI)
+        file_context_remove(&litechr_file_context_pool, &litechr_file_contexts, popened_file->pfile_ctx);
+    // The channel is removed with its last file
+    if (popened_file->mode == OPENED_FILE_CHANNEL)
+        litechr_channel_put(popened_file->pfile_ctx);
+
+    if (popened_file->mode == OPENED_FILE_EXCLUSIVE) {
+        // Clear driver mode before the shared context can be reached by other files again
+        litechr_file_context.data_queue.spsc = false;
+        atomic_set_release(&litechr_opened_files_count, 0);
     }
-    
-    mutex_unlock(&litechr_openclose_mtx);
+    else
+        atomic_dec(&litechr_opened_files_count);
+
+    pfile->private_data = NULL;
+    kmem_cache_free(plitechr_opened_file_cache, popened_file);
     
     //pr_info("Closed file\n");
 
     return 0;
 }
+EXPORT_SYMBOL_IF_KUNIT(litechr_release);
 
-// Driver read file callback
-static ssize_t litechr_read(struct file *pfile, char *ubuf, size_t length, loff_t *poffset)
+// Driver read file callback (also used for vectored and asynchronous reads)
+static ssize_t litechr_read_iter(struct kiocb *piocb, struct iov_iter *pto)
 {
+    struct file *pfile = piocb->ki_filp;
+    struct opened_file *popened_file = pfile->private_data;
     struct file_context *pfile_ctx;
-    char *kbuf;
-    //if (*poffset != 0)
+    struct data_queue *pqueue;
+    size_t length, size = 0;
+    u64 lock_start, lock_wait;
+    bool nowait, tracing;
+    ssize_t ret;
+    //if (piocb->ki_pos != 0)
     //    return -ESPIPE;
+    length = iov_iter_count(pto);
     if (length == 0)
         return -EINVAL;
-    if (ubuf == NULL)
-        return -EINVAL;
     
-    // If the file is opened in separate context, use it's unique context
-    if (pfile->private_data) {
-        pfile_ctx = pfile->private_data;
-    }
-    // Otherwise use shared context
-    else {
-        pfile_ctx = &litechr_file_context;
-    }
+    pfile_ctx = litechr_file_context_get(pfile);
+    pqueue = &pfile_ctx->data_queue;
+    // Asynchronous submitters (io_uring) ask not to block at all, including on the queue locks
+    nowait = piocb->ki_flags & IOCB_NOWAIT;
+    tracing = trace_litechr_read_enabled();
     
-    if (mutex_lock_interruptible(&pfile_ctx->data_queue.mtx))
-        return -EINTR;
+    lock_start = litechr_trace_clock(tracing);
+    ret = file_context_lock_reader(pfile_ctx, nowait);
+    if (ret)
+        return ret;
+    lock_wait = litechr_trace_clock(tracing) - lock_start;
 
-    length = min(length, pfile_ctx->data_queue.size);
-    
-    kbuf = kmalloc(length, GFP_KERNEL);
-    if (kbuf == NULL) {
-        mutex_unlock(&pfile_ctx->data_queue.mtx);
-        return -ENOMEM;
+    // The leased bytes have to be committed first, the file would wait for itself otherwise
+    if (file_context_leased(pfile_ctx) && READ_ONCE(pfile_ctx->lease.powner) == popened_file) {
+        file_context_unlock_reader(pfile_ctx);
+        return -EBUSY;
     }
 
-    length = file_context_data_queue_read_to_buffer(pfile_ctx, kbuf, length);
+    // In broadcast mode a file starts receiving data with its first read
+    file_context_cursor_attach(pfile_ctx, &popened_file->cursor);
 
-    mutex_unlock(&pfile_ctx->data_queue.mtx);
-
-    if (copy_to_user(ubuf, kbuf, length)) {
-        kfree(kbuf);
-        return -EFAULT;
+    // Wait for data to arrive unless the file is opened in non-blocking mode
+    while (!litechr_file_readable(popened_file)) {
+        file_context_unlock_reader(pfile_ctx);
+        // Without data a nowait request has to be retried when the file gets readable
+        if (nowait)
+            return -EAGAIN;
+        if (pfile->f_flags & O_NONBLOCK)
+            return 0;
+        if (READ_ONCE(pfile_ctx->flags) & LITECHR_CTX_BROADCAST) {
+            // Every reader of a broadcast gets the data, so all of them are woken up
+            if (wait_event_interruptible(pqueue->rd_wq, litechr_file_readable(popened_file)))
+                return -ERESTARTSYS;
+        }
+        // Readers wait exclusively, so a write wakes only one of them
+        else if (wait_event_interruptible_exclusive(pqueue->rd_wq, litechr_file_readable(popened_file))) {
+            // Do not swallow the wakeup that may have been meant for this reader
+            wake_up_interruptible(&pqueue->rd_wq);
+            return -ERESTARTSYS;
+        }
+        lock_start = litechr_trace_clock(tracing);
+        if (file_context_lock_reader(pfile_ctx, false))
+            return -EINTR;
+        lock_wait += litechr_trace_clock(tracing) - lock_start;
+        file_context_cursor_attach(pfile_ctx, &popened_file->cursor);
     }
 
-    kfree(kbuf);
+    if (tracing)
+        size = file_context_size(pfile_ctx);
+    // The whole iterator is filled under a single lock acquisition
+    if (pfile_ctx->flags & LITECHR_CTX_BROADCAST)
+        ret = file_context_cursor_read_to_iter(pfile_ctx, &popened_file->cursor, pto);
+    else
+        ret = file_context_data_queue_read_to_iter(pfile_ctx, pto);
+    if (tracing)
+        trace_litechr_read(pfile_ctx->id, length, ret, size, file_context_size(pfile_ctx), lock_wait);
+
+    // Pass the wakeup on to the next reader if some data is left (readers of a broadcast are all woken up)
+    if (!(pfile_ctx->flags & LITECHR_CTX_BROADCAST) && file_context_readable(pfile_ctx))
+        wake_up_interruptible(&pqueue->rd_wq);
+
+    file_context_unlock_reader(pfile_ctx);
+
+    if (ret > 0)
+        wake_up_interruptible(&pqueue->wr_wq);
 
-    return length;
+    return ret;
 }
 
-// Driver write file callback
-static ssize_t litechr_write(struct file *pfile, const char *ubuf, size_t length, loff_t *poffset)
+// Driver write file callback (also used for vectored and asynchronous writes)
+static ssize_t litechr_write_iter(struct kiocb *piocb, struct iov_iter *pfrom)
 {
+    struct file *pfile = piocb->ki_filp;
     struct file_context *pfile_ctx;
-    uint8_t *kbuf;
+    struct data_queue *pqueue, *pwqueue;
+    size_t length, required, size = 0;
+    u64 lock_start, lock_wait;
+    bool partial, records, nowait, tracing;
+    ssize_t ret;
     
-    //if (*poffset != 0)
+    //if (piocb->ki_pos != 0)
     //    return -ESPIPE;
+    length = iov_iter_count(pfrom);
     if (length == 0)
         return -EINVAL;
-    if (ubuf == NULL)
-        return -EINVAL;
 
-    // If the file is opened in separate context, use it's unique context
-    if (pfile->private_data) {
-        pfile_ctx = pfile->private_data;
-    }
-    // Otherwise use shared context
-    else {
-        pfile_ctx = &litechr_file_context;
+    pfile_ctx = litechr_file_context_get(pfile);
+    pqueue = &pfile_ctx->data_queue;
+    // Asynchronous submitters (io_uring) ask not to block at all, including on the queue locks
+    nowait = piocb->ki_flags & IOCB_NOWAIT;
+    tracing = trace_litechr_write_enabled();
+
+    // In partial write mode any free space is enough, otherwise the whole buffer has to fit
+    // (a record is never split, so partial write mode does not apply to it)
+    records = READ_ONCE(pfile_ctx->flags) & LITECHR_CTX_RECORDS;
+    partial = !records && (READ_ONCE(((struct opened_file *)pfile->private_data)->flags) & LITECHR_FILE_PARTIAL_WRITE);
+    required = partial ? 1 : length;
+
+    // The data will never fit, so there is no point in waiting
+    if (required > READ_ONCE(pqueue->limit) - file_context_write_overhead(pfile_ctx)) {
+        ret = records ? -EMSGSIZE : -ENOBUFS;
+        litechr_stats_rejected(ret);
+        return ret;
     }
     
-    if (mutex_lock_interruptible(&pfile_ctx->data_queue.mtx))
+    // A sharded context is written through the sub-queue of the current CPU
+    lock_start = litechr_trace_clock(tracing);
+    pwqueue = file_context_lock_writer(pfile_ctx, nowait);
+    if (IS_ERR(pwqueue))
+        return PTR_ERR(pwqueue);
+    lock_wait = litechr_trace_clock(tracing) - lock_start;
+
+    // Slow readers of a broadcast lose the oldest data instead of holding the writers back
+    if (pfile_ctx->flags & LITECHR_CTX_BROADCAST_DROP)
+        file_context_broadcast_drop(pfile_ctx, length + file_context_write_overhead(pfile_ctx));
+
+    // Wait for enough free space unless the file is opened in non-blocking mode
+    while (required > file_context_queue_space(pfile_ctx, pwqueue)) {
+        data_queue_unlock_writer(pwqueue);
+        // A nowait request has to be retried when the file gets writable
+        if (nowait)
+            return -EAGAIN;
+        if (pfile->f_flags & O_NONBLOCK) {
+            ret = partial ? -EAGAIN : -ENOBUFS;
+            litechr_stats_rejected(ret);
+            return ret;
+        }
+        // A shrinking resize wakes the writers up as well, the data may never fit after it
+        if (wait_event_interruptible(pqueue->wr_wq, required <= file_context_space(pfile_ctx) ||
+                                     required > READ_ONCE(pqueue->limit) - file_context_write_overhead(pfile_ctx)))
+            return -ERESTARTSYS;
+        lock_start = litechr_trace_clock(tracing);
+        pwqueue = file_context_lock_writer(pfile_ctx, false);
+        if (IS_ERR(pwqueue))
+            return PTR_ERR(pwqueue);
+        lock_wait += litechr_trace_clock(tracing) - lock_start;
+        // The limit is stable under the writer lock
+        if (required > pqueue->limit - file_context_write_overhead(pfile_ctx)) {
+            data_queue_unlock_writer(pwqueue);
+            ret = records ? -EMSGSIZE : -ENOBUFS;
+            litechr_stats_rejected(ret);
+            return ret;
+        }
+    }
+
+    if (tracing)
+        size = file_context_size(pfile_ctx);
+    // The whole iterator is stored under a single lock acquisition
+    // A nowait request is retried from a worker if the data pages have to be allocated
+    ret = file_context_data_queue_write_from_iter(pfile_ctx, pwqueue, pfrom, nowait);
+    if (tracing)
+        trace_litechr_write(pfile_ctx->id, length, ret, size, file_context_size(pfile_ctx), lock_wait);
+
+    data_queue_unlock_writer(pwqueue);
+
+    if (ret > 0)
+        wake_up_interruptible(&pqueue->rd_wq);
+    // Count writes rejected because the data pages did not fit the storage budget
+    else if (ret < 0)
+        litechr_stats_rejected(ret);
+
+    return ret;
+}
+
+// Driver splice from pipe callback
+static ssize_t litechr_splice_write(struct pipe_inode_info *ppipe, struct file *pfile, loff_t *ppos, size_t length, unsigned int flags)
+{
+    struct file_context *pfile_ctx = litechr_file_context_get(pfile);
+    size_t max_length;
+
+    // The pipe may hold more than the queue can ever take at once, and a write of the whole of it
+    // would fail, so move it in parts (the rest stays in the pipe for the next call)
+    max_length = READ_ONCE(pfile_ctx->data_queue.limit) - file_context_write_overhead(pfile_ctx);
+    return iter_file_splice_write(ppipe, pfile, ppos, min(length, max_length), flags);
+}
+
+// Driver poll file callback
+static __poll_t litechr_poll(struct file *pfile, struct poll_table_struct *pwait)
+{
+    struct file_context *pfile_ctx = litechr_file_context_get(pfile);
+    __poll_t mask = 0;
+
+    poll_wait(pfile, &pfile_ctx->data_queue.rd_wq, pwait);
+    poll_wait(pfile, &pfile_ctx->data_queue.wr_wq, pwait);
+
+    if (litechr_file_readable(pfile->private_data))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    // Writes to a broadcast dropping old data never wait
+    if (file_context_space(pfile_ctx) || (READ_ONCE(pfile_ctx->flags) & LITECHR_CTX_BROADCAST_DROP))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+// Ring mapping open callback (the mapping is duplicated, e.g. on fork)
+static void litechr_vm_open(struct vm_area_struct *pvma)
+{
+    struct data_queue *pqueue = pvma->vm_private_data;
+
+    atomic_inc(&pqueue->mmap_count);
+}
+
+// Ring mapping close callback
+static void litechr_vm_close(struct vm_area_struct *pvma)
+{
+    struct data_queue *pqueue = pvma->vm_private_data;
+
+    atomic_dec(&pqueue->mmap_count);
+}
+
+// Ring mapping operations (keep track of the mappings so the ring is not replaced under them)
+static const struct vm_operations_struct litechr_vm_ops = {
+    .open = litechr_vm_open,
+    .close = litechr_vm_close,
+};
+
+// Driver mmap callback
+static int litechr_mmap(struct file *pfile, struct vm_area_struct *pvma)
+{
+    struct data_queue *pqueue = &litechr_file_context_get(pfile)->data_queue;
+    unsigned long nr_pages = vma_pages(pvma);
+    int ret;
+
+    // Private mapping would get copies of the pages instead of the ring itself
+    if (!(pvma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    // Sub-queues of a sharded context are not exposed
+    if (litechr_file_context_get(pfile)->shards.count)
+        return -EOPNOTSUPP;
+
+    // Do not let the ring be resized or its pages freed while it is being mapped
+    // (the queue mutexes can not be used, readers and writers fault while holding them and mmap_lock is held here)
+    if (mutex_lock_interruptible(&pqueue->map_mtx))
         return -EINTR;
 
-    if (length > MAX_BUFFER_SIZE - pfile_ctx->data_queue.size) {
-        mutex_unlock(&pfile_ctx->data_queue.mtx);
-        return -ENOBUFS;
+    // The ring is mapped starting from the header page, the header alone may be mapped to learn the ring size
+    if (pvma->vm_pgoff != 0 || nr_pages > pqueue->nr_pages) {
+        ret = -EINVAL;
+        goto unlock;
     }
-    kbuf = kmalloc(length, GFP_KERNEL);
-    if (kbuf == NULL) {
-        mutex_unlock(&pfile_ctx->data_queue.mtx);
-        return -ENOMEM;
+    // Data pages freed while the context was idle are needed again (they are kept while mapped)
+    if (nr_pages > 1 && (ret = file_context_storage_get(litechr_file_context_get(pfile))) < 0) {
+        litechr_stats_rejected(ret);
+        goto unlock;
     }
 
-    if (copy_from_user(kbuf, ubuf, length)) {
-        mutex_unlock(&pfile_ctx->data_queue.mtx);
-        kfree(kbuf);
-        return -EFAULT;
+    pvma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    pvma->vm_ops = &litechr_vm_ops;
+    pvma->vm_private_data = pqueue;
+
+    // The mapping holds its own page references, so the pages outlive the file context if needed
+    ret = vm_insert_pages(pvma, pvma->vm_start, pqueue->pages, &nr_pages);
+    // A failed mmap is torn down without the close callback, so count only successful ones
+    if (ret == 0)
+        atomic_inc(&pqueue->mmap_count);
+
+unlock:
+    mutex_unlock(&pqueue->map_mtx);
+    return ret;
+}
+
+// Open a file using the context of the numbered channel, creating the channel if it does not exist
+static int litechr_channel_open(u32 channel, struct file *pfile)
+{
+    struct opened_file *popened_file;
+    struct file *pnew_file;
+    int fd, ret;
+
+    popened_file = kmem_cache_zalloc(plitechr_opened_file_cache, GFP_KERNEL);
+    if (popened_file == NULL)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&popened_file->cursor.node);
+    popened_file->mode = OPENED_FILE_CHANNEL;
+
+    // Channel files count as opened files of the device
+    if ((ret = litechr_opened_files_inc()) < 0)
+        goto err_free;
+
+    popened_file->pfile_ctx = litechr_channel_get(channel);
+    if (IS_ERR(popened_file->pfile_ctx)) {
+        ret = PTR_ERR(popened_file->pfile_ctx);
+        if (ret == -EBUSY)
+            pr_err("Reached maximum file contexts count\n");
+        goto err_dec;
     }
 
-    length = file_context_data_queue_write_from_buffer(pfile_ctx, kbuf, length);
+    fd = get_unused_fd_flags(O_CLOEXEC);
+    if (fd < 0) {
+        ret = fd;
+        goto err_put;
+    }
+    // The new file is released through litechr_release like the device files
+    pnew_file = anon_inode_getfile(DEVICE_NAME, &litechr_fops, popened_file, O_RDWR | (pfile->f_flags & O_NONBLOCK));
+    if (IS_ERR(pnew_file)) {
+        ret = PTR_ERR(pnew_file);
+        put_unused_fd(fd);
+        goto err_put;
+    }
+    pnew_file->f_mode |= FMODE_NOWAIT;
+    this_cpu_inc(litechr_stats.opens[OPENED_FILE_CHANNEL]);
+    trace_litechr_open(popened_file->pfile_ctx->id, popened_file->mode, 0);
+    fd_install(fd, pnew_file);
+    return fd;
 
-    mutex_unlock(&pfile_ctx->data_queue.mtx);
+err_put:
+    litechr_channel_put(popened_file->pfile_ctx);
+err_dec:
+    atomic_dec(&litechr_opened_files_count);
+err_free:
+    kmem_cache_free(plitechr_opened_file_cache, popened_file);
+    litechr_stats_rejected(ret);
+    trace_litechr_open(0, OPENED_FILE_CHANNEL, ret);
+    return ret;
+}
 
-    kfree(kbuf);
+// Driver ioctl callback
+static long litechr_ioctl(struct file *pfile, unsigned int cmd, unsigned long arg)
+{
+    struct opened_file *popened_file = pfile->private_data;
+    unsigned int __user *parg = (unsigned int __user *)arg;
+    struct litechr_reserve reserve;
+    struct litechr_peek peek;
+    struct data_queue *pqueue;
+    unsigned int flags, size;
+    u32 channel;
+    size_t old_size;
+    int ret;
 
-    return length;
+    switch (cmd) {
+    case LITECHR_IOC_GET_FLAGS:
+        return put_user(READ_ONCE(popened_file->flags), parg);
+    case LITECHR_IOC_SET_FLAGS:
+        if (get_user(flags, parg))
+            return -EFAULT;
+        if (flags & ~LITECHR_FILE_FLAGS_MASK)
+            return -EINVAL;
+        WRITE_ONCE(popened_file->flags, flags);
+        return 0;
+    case LITECHR_IOC_GET_SIZE:
+        return put_user(READ_ONCE(popened_file->pfile_ctx->data_queue.limit), parg);
+    case LITECHR_IOC_SET_SIZE:
+        if (get_user(size, parg))
+            return -EFAULT;
+        if (size == 0 || size > litechr_max_buffer_size)
+            return -EINVAL;
+        if (popened_file->pfile_ctx->shards.count)
+            return -EOPNOTSUPP;
+        pqueue = &popened_file->pfile_ctx->data_queue;
+        if (data_queue_lock(pqueue))
+            return -EINTR;
+        old_size = pqueue->limit;
+        ret = file_context_data_queue_resize(popened_file->pfile_ctx, size);
+        data_queue_unlock(pqueue);
+        trace_litechr_context_resize(popened_file->pfile_ctx->id, old_size, size, ret);
+        litechr_stats_rejected(ret);
+        // Writers may fit now (or never fit any more)
+        wake_up_interruptible(&pqueue->wr_wq);
+        return ret;
+    case LITECHR_IOC_GET_CTX_FLAGS:
+        return put_user(READ_ONCE(popened_file->pfile_ctx->flags), parg);
+    case LITECHR_IOC_SET_CTX_FLAGS:
+        if (get_user(flags, parg))
+            return -EFAULT;
+        if (flags & ~LITECHR_CTX_FLAGS_MASK)
+            return -EINVAL;
+        pqueue = &popened_file->pfile_ctx->data_queue;
+        if (data_queue_lock(pqueue))
+            return -EINTR;
+        ret = file_context_flags_set(popened_file->pfile_ctx, flags);
+        data_queue_unlock(pqueue);
+        litechr_stats_rejected(ret);
+        // Writers waiting for space may fit now or have to fail
+        wake_up_interruptible(&pqueue->wr_wq);
+        return ret;
+    case LITECHR_IOC_RESET_LATENCY:
+        if (popened_file->pfile_ctx->platency == NULL)
+            return -EOPNOTSUPP;
+        // The histogram is only changed by readers
+        if (file_context_lock_reader(popened_file->pfile_ctx, false))
+            return -EINTR;
+        file_context_latency_reset(popened_file->pfile_ctx);
+        file_context_unlock_reader(popened_file->pfile_ctx);
+        return 0;
+    case FIONREAD:
+        // Records and chunks are looked at in place, so they must not be consumed meanwhile
+        if (file_context_lock_reader(popened_file->pfile_ctx, false))
+            return -EINTR;
+        if (popened_file->pfile_ctx->flags & LITECHR_CTX_BROADCAST)
+            size = file_context_cursor_read_size(popened_file->pfile_ctx, &popened_file->cursor);
+        else
+            size = file_context_read_size(popened_file->pfile_ctx);
+        file_context_unlock_reader(popened_file->pfile_ctx);
+        return put_user(size, (int __user *)arg);
+    case LITECHR_IOC_PEEK:
+        if (copy_from_user(&peek, (void __user *)arg, sizeof(peek)))
+            return -EFAULT;
+        if (peek.reserved)
+            return -EINVAL;
+        if (file_context_lock_reader(popened_file->pfile_ctx, false))
+            return -EINTR;
+        ret = file_context_data_queue_peek(popened_file->pfile_ctx, u64_to_user_ptr(peek.buf), peek.length);
+        file_context_unlock_reader(popened_file->pfile_ctx);
+        return ret;
+    case LITECHR_IOC_RESERVE:
+        if (copy_from_user(&reserve, (void __user *)arg, sizeof(reserve)))
+            return -EFAULT;
+        if (file_context_lock_reader(popened_file->pfile_ctx, false))
+            return -EINTR;
+        ret = file_context_lease(popened_file->pfile_ctx, popened_file, u64_to_user_ptr(reserve.buf), reserve.length,
+            &reserve.pos);
+        file_context_unlock_reader(popened_file->pfile_ctx);
+        litechr_stats_rejected(ret);
+        if (ret > 0 && put_user(reserve.pos, &((struct litechr_reserve __user *)arg)->pos)) {
+            // The caller could not learn where the data is, so it must not keep it from others
+            litechr_file_context_lease_release(popened_file);
+            return -EFAULT;
+        }
+        return ret;
+    case LITECHR_IOC_COMMIT:
+        if (get_user(size, parg))
+            return -EFAULT;
+        pqueue = &popened_file->pfile_ctx->data_queue;
+        if (file_context_lock_reader(popened_file->pfile_ctx, false))
+            return -EINTR;
+        ret = file_context_lease_commit(popened_file->pfile_ctx, popened_file, size);
+        // Other readers may take the rest of the data now
+        if (ret == 0 && file_context_readable(popened_file->pfile_ctx))
+            wake_up_interruptible(&pqueue->rd_wq);
+        file_context_unlock_reader(popened_file->pfile_ctx);
+        if (ret == 0 && size)
+            wake_up_interruptible(&pqueue->wr_wq);
+        return ret;
+    case LITECHR_IOC_OPEN_CHANNEL:
+        if (get_user(channel, (u32 __user *)arg))
+            return -EFAULT;
+        return litechr_channel_open(channel, pfile);
+    case LITECHR_IOC_NOTIFY:
+        wake_up_interruptible(&popened_file->pfile_ctx->data_queue.rd_wq);
+        wake_up_interruptible(&popened_file->pfile_ctx->data_queue.wr_wq);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
 }
 
 // Set access rights for the device file
@@ -340,6 +1025,145 @@ static int litechr_uevent(struct device *pdev, struct kobj_uevent_env *penv)
     return 0;
 }
 
+// Show file context pool statistics
+static int litechr_context_pool_show(struct seq_file *pseq, void *pdata)
+{
+    struct file_context_pool *ppool = &litechr_file_context_pool;
+    unsigned long hits, misses, drops, shrunk;
+    unsigned int count;
+    u64 rate;
+
+    spin_lock(&ppool->lock);
+    hits = ppool->hits;
+    misses = ppool->misses;
+    drops = ppool->drops;
+    shrunk = ppool->shrunk;
+    count = ppool->count;
+    spin_unlock(&ppool->lock);
+
+    seq_printf(pseq, "pooled: %u/%u\n", count, ppool->max_count);
+    seq_printf(pseq, "hits: %lu\n", hits);
+    seq_printf(pseq, "misses: %lu\n", misses);
+    seq_printf(pseq, "drops: %lu\n", drops);
+    seq_printf(pseq, "shrunk: %lu\n", shrunk);
+    seq_printf(pseq, "memory: %zu\n", file_context_pool_memory(ppool));
+    // Hit rate in hundredths of percent
+    rate = hits + misses ? div64_u64((u64)hits * 10000, (u64)hits + misses) : 0;
+    seq_printf(pseq, "hit_rate: %llu.%02llu%%\n", rate / 100, rate % 100);
+    return 0;
+}
+
+// Show driver statistics in debugfs
+static int litechr_stats_show(struct seq_file *pseq, void *pdata)
+{
+    struct file_context_stats ctx_stats = {0};
+    struct litechr_stats stats = {0};
+    struct litechr_stats *pcpu_stats;
+    struct file_context *pfile_ctx;
+    unsigned long id;
+    int cpu, mode;
+
+    for_each_possible_cpu(cpu) {
+        pcpu_stats = per_cpu_ptr(&litechr_stats, cpu);
+        for (mode = 0; mode < OPENED_FILE_MODES; mode++) {
+            stats.opens[mode] += pcpu_stats->opens[mode];
+            stats.closes[mode] += pcpu_stats->closes[mode];
+        }
+        stats.rejected_enobufs += pcpu_stats->rejected_enobufs;
+        stats.rejected_ebusy += pcpu_stats->rejected_ebusy;
+        stats.rejected_emfile += pcpu_stats->rejected_emfile;
+    }
+
+    // Traffic totals are the sum of the live contexts and the ones removed already
+    // (a context being removed right now may be counted twice)
+    file_context_stats_sum(&litechr_file_context, &ctx_stats);
+    xa_lock(&litechr_file_contexts);
+    xa_for_each(&litechr_file_contexts, id, pfile_ctx) {
+        file_context_stats_sum(pfile_ctx, &ctx_stats);
+    }
+    xa_unlock(&litechr_file_contexts);
+    file_context_pool_stats_sum(&litechr_file_context_pool, &ctx_stats);
+
+    seq_printf(pseq, "opened_files: %d\n", atomic_read(&litechr_opened_files_count));
+    seq_printf(pseq, "opens: shared %llu exclusive %llu multi %llu channel %llu\n",
+        stats.opens[OPENED_FILE_SHARED], stats.opens[OPENED_FILE_EXCLUSIVE], stats.opens[OPENED_FILE_MULTI],
+        stats.opens[OPENED_FILE_CHANNEL]);
+    seq_printf(pseq, "closes: shared %llu exclusive %llu multi %llu channel %llu\n",
+        stats.closes[OPENED_FILE_SHARED], stats.closes[OPENED_FILE_EXCLUSIVE], stats.closes[OPENED_FILE_MULTI],
+        stats.closes[OPENED_FILE_CHANNEL]);
+    seq_printf(pseq, "read_bytes: %llu\n", ctx_stats.read_bytes);
+    seq_printf(pseq, "reads: %llu\n", ctx_stats.reads);
+    seq_printf(pseq, "write_bytes: %llu\n", ctx_stats.write_bytes);
+    seq_printf(pseq, "writes: %llu\n", ctx_stats.writes);
+    seq_printf(pseq, "lock_contended: %llu\n", ctx_stats.lock_contended);
+    seq_printf(pseq, "rejected_enobufs: %llu\n", stats.rejected_enobufs);
+    seq_printf(pseq, "rejected_ebusy: %llu\n", stats.rejected_ebusy);
+    seq_printf(pseq, "rejected_emfile: %llu\n", stats.rejected_emfile);
+    seq_printf(pseq, "storage: %zu/%lu\n", file_context_budget_used(&litechr_file_context_budget), litechr_storage_budget);
+    return 0;
+}
+
+// Show statistics of a file context in debugfs
+static void litechr_context_show(struct seq_file *pseq, struct file_context *pfile_ctx)
+{
+    struct file_context_stats stats = {0};
+
+    file_context_stats_sum(pfile_ctx, &stats);
+    seq_printf(pseq, "%u %zu %zu %zu %llu %llu %llu %llu %llu %zu\n", pfile_ctx->id,
+        file_context_size(pfile_ctx), READ_ONCE(pfile_ctx->max_size), READ_ONCE(pfile_ctx->data_queue.limit),
+        stats.read_bytes, stats.reads, stats.write_bytes, stats.writes, stats.lock_contended,
+        file_context_memory(pfile_ctx));
+}
+
+// Show statistics of every file context in debugfs
+static int litechr_contexts_show(struct seq_file *pseq, void *pdata)
+{
+    struct file_context *pfile_ctx;
+    unsigned long id;
+
+    seq_puts(pseq, "id size max_size limit read_bytes reads write_bytes writes lock_contended memory\n");
+    litechr_context_show(pseq, &litechr_file_context);
+    // The registry lock keeps the contexts from being removed while they are shown
+    xa_lock(&litechr_file_contexts);
+    xa_for_each(&litechr_file_contexts, id, pfile_ctx) {
+        litechr_context_show(pseq, pfile_ctx);
+    }
+    xa_unlock(&litechr_file_contexts);
+    return 0;
+}
+
+// Show latency histogram of a file context
+static void litechr_context_latency_show(struct seq_file *pseq, struct file_context *pfile_ctx)
+{
+    unsigned int i;
+    u64 count;
+
+    seq_printf(pseq, "%u %lu\n", pfile_ctx->id, file_context_stamps_dropped(pfile_ctx));
+    // Only the buckets holding some chunks are shown
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        count = READ_ONCE(pfile_ctx->platency->buckets[i]);
+        if (count)
+            seq_printf(pseq, "  %llu %llu\n", 1ull << i, count);
+    }
+}
+
+// Show latency histograms of every file context in debugfs
+static int litechr_latency_show(struct seq_file *pseq, void *pdata)
+{
+    struct file_context *pfile_ctx;
+    unsigned long id;
+
+    seq_puts(pseq, "id stamps_dropped\n  min_latency_ns count\n");
+    litechr_context_latency_show(pseq, &litechr_file_context);
+    // The registry lock keeps the contexts from being removed while they are shown
+    xa_lock(&litechr_file_contexts);
+    xa_for_each(&litechr_file_contexts, id, pfile_ctx) {
+        litechr_context_latency_show(pseq, pfile_ctx);
+    }
+    xa_unlock(&litechr_file_contexts);
+    return 0;
+}
+
 module_init(litechr_init);
 module_exit(litechr_exit);
 
@@ -1,13 +1,65 @@
 #pragma once
 
+// Mode the file was opened in
+enum opened_file_mode {
+    OPENED_FILE_SHARED,
+    OPENED_FILE_EXCLUSIVE,
+    OPENED_FILE_MULTI,
+    // File created with LITECHR_IOC_OPEN_CHANNEL, using the context of a numbered channel
+    OPENED_FILE_CHANNEL,
+    // Number of modes
+    OPENED_FILE_MODES,
+};
+
+// Opened file state (stored in file private data)
+struct opened_file {
+    // File context used for reading and writing
+    struct file_context *pfile_ctx;
+    // Mode the file was opened in
+    enum opened_file_mode mode;
+    // Per file flags (LITECHR_FILE_*)
+    unsigned int flags;
+    // Read position in a broadcast mode context
+    struct file_context_cursor cursor;
+};
+
+// Driver counters (kept per CPU, so that counting does not make shared cache lines bounce)
+struct litechr_stats {
+    // Number of successful opens per mode
+    u64 opens[OPENED_FILE_MODES];
+    // Number of closes per mode
+    u64 closes[OPENED_FILE_MODES];
+    // Number of requests rejected with -ENOBUFS
+    u64 rejected_enobufs;
+    // Number of requests rejected with -EBUSY
+    u64 rejected_ebusy;
+    // Number of opens rejected with -EMFILE
+    u64 rejected_emfile;
+};
+
+// Value of the opened files count while the file is opened in exclusive mode
+#define OPENED_FILES_EXCLUSIVE  (-1)
+
+// Get the file context used by the opened file
+static inline struct file_context* litechr_file_context_get(struct file *pfile)
+{
+    return ((struct opened_file *)pfile->private_data)->pfile_ctx;
+}
+
+// Driver state and functions the KUnit suites in litechr_kunit.c reach (static without CONFIG_LITECHR_KUNIT_TEST)
+#if IS_ENABLED(CONFIG_LITECHR_KUNIT_TEST)
+extern unsigned int litechr_max_opened_files;
+extern unsigned int litechr_max_file_contexts;
+extern atomic_t litechr_opened_files_count;
+extern struct file_context litechr_file_context;
+extern struct xarray litechr_file_contexts;
+extern struct xarray litechr_channels;
+// Get the context of the numbered channel for a new file, creating the channel if it does not exist
+struct file_context* litechr_channel_get(u32 channel);
+// Drop the reference of a closed file to the channel context, removing the channel with the last one
+void litechr_channel_put(struct file_context *pfile_ctx);
 // Driver open file callback
-static int litechr_open(struct inode *pinode, struct file *pfile);
+int litechr_open(struct inode *pinode, struct file *pfile);
 // Driver close file callback
-static int litechr_release(struct inode *pinode, struct file *pfile);
-// Driver read file callback
-static ssize_t litechr_read(struct file *pfile, char *ubuf, size_t length, loff_t *poffset);
-// Driver write file callback
-static ssize_t litechr_write(struct file *pfile, const char *ubuf, size_t length, loff_t *poffset);
-
-// Set access rights for the device file
-static int litechr_uevent(struct device *pdev, struct kobj_uevent_env *penv);
+int litechr_release(struct inode *pinode, struct file *pfile);
+#endif
@@ -0,0 +1,102 @@
+#pragma once
+
+// Interface shared between the driver and user space programs
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define LITECHR_IOC_MAGIC               0xE1
+
+// Header of the memory mapped queue ring.
+// The mapping starts with a page holding the header followed by capacity bytes of ring data.
+// Producers store data at (head % capacity) and then advance head, consumers take data
+// at (tail % capacity) and then advance tail. Both indexes run freely and wrap at 2^32,
+// the number of stored bytes is (head - tail) and must not exceed limit.
+// Indexes have to be published with store-release and observed with load-acquire.
+struct litechr_ring_header {
+    // Size of the ring data in bytes (power of two)
+    __u32 capacity;
+    // Maximum number of bytes the ring may hold
+    __u32 limit;
+    __u32 reserved0[14];
+    // Free running write index (on its own cache line)
+    __u32 head;
+    __u32 reserved1[15];
+    // Free running read index (on its own cache line)
+    __u32 tail;
+    __u32 reserved2[15];
+};
+
+// Request to copy bytes from the head of the queue without removing them (LITECHR_IOC_PEEK)
+struct litechr_peek {
+    // User space buffer address
+    __u64 buf;
+    // Size of the buffer in bytes
+    __u32 length;
+    // Must be 0
+    __u32 reserved;
+};
+
+// Request to lease bytes at the head of the queue until they are committed (LITECHR_IOC_RESERVE)
+struct litechr_reserve {
+    // User space buffer the leased bytes are copied to (0 to read them through the memory mapping)
+    __u64 buf;
+    // Maximum number of bytes to lease (of the record data to copy in record mode)
+    __u32 length;
+    // Set by the driver to the free running ring index of the leased data
+    __u32 pos;
+};
+
+// Per file flags
+
+// Write as many bytes as fit into the queue and return their count instead of failing when the whole buffer does not fit
+#define LITECHR_FILE_PARTIAL_WRITE      (1u << 0)
+#define LITECHR_FILE_FLAGS_MASK         (LITECHR_FILE_PARTIAL_WRITE)
+
+// File context flags (shared by all files using the context)
+
+// Store every write as a single record and return exactly one record per read
+#define LITECHR_CTX_RECORDS             (1u << 0)
+// Deliver every byte (or record) to each reading file, which reads at its own cursor
+// (not available for a context with a single opener or for the sharded shared context)
+#define LITECHR_CTX_BROADCAST           (1u << 1)
+// In broadcast mode drop the oldest data for writers instead of letting them wait for the slowest reader,
+// a reader which missed the dropped data gets EPIPE once
+#define LITECHR_CTX_BROADCAST_DROP      (1u << 2)
+#define LITECHR_CTX_FLAGS_MASK          (LITECHR_CTX_RECORDS | LITECHR_CTX_BROADCAST | LITECHR_CTX_BROADCAST_DROP)
+
+// In record mode every record is stored in the ring as a __u32 length followed by the record data (without padding)
+#define LITECHR_RECORD_HEADER_SIZE      sizeof(__u32)
+
+// Get per file flags
+#define LITECHR_IOC_GET_FLAGS           _IOR(LITECHR_IOC_MAGIC, 0, __u32)
+// Set per file flags
+#define LITECHR_IOC_SET_FLAGS           _IOW(LITECHR_IOC_MAGIC, 1, __u32)
+// Wake up readers and writers waiting on the queue after it was changed through the memory mapping
+#define LITECHR_IOC_NOTIFY              _IO(LITECHR_IOC_MAGIC, 2)
+// Get the number of bytes the file context queue can hold
+#define LITECHR_IOC_GET_SIZE            _IOR(LITECHR_IOC_MAGIC, 3, __u32)
+// Set the number of bytes the file context queue can hold (the stored data is kept)
+#define LITECHR_IOC_SET_SIZE            _IOW(LITECHR_IOC_MAGIC, 4, __u32)
+// Get file context flags
+#define LITECHR_IOC_GET_CTX_FLAGS       _IOR(LITECHR_IOC_MAGIC, 5, __u32)
+// Set file context flags (the context has to be empty to change the record mode)
+#define LITECHR_IOC_SET_CTX_FLAGS       _IOW(LITECHR_IOC_MAGIC, 6, __u32)
+// Reset the latency histogram of the file context (fails with EOPNOTSUPP unless latency is measured)
+#define LITECHR_IOC_RESET_LATENCY       _IO(LITECHR_IOC_MAGIC, 7)
+// Copy bytes (or the next record in record mode, truncated to the buffer) from the head of the queue without removing them
+// Returns the number of bytes copied (the number of queued bytes or the length of the next record is reported by FIONREAD)
+#define LITECHR_IOC_PEEK                _IOW(LITECHR_IOC_MAGIC, 8, struct litechr_peek)
+// Lease bytes (or the next record in record mode) at the head of the queue to the file, copying them to the buffer
+// The bytes stay in the queue and other readers wait until the lease ends, a file holding a lease can not read (EBUSY)
+// Returns the number of leased bytes (0 if the queue is empty) or fails with EBUSY if the queue is leased already
+#define LITECHR_IOC_RESERVE             _IOWR(LITECHR_IOC_MAGIC, 9, struct litechr_reserve)
+// Remove the given number of leased bytes (the whole record in record mode unless 0) from the queue and end the lease,
+// the rest of the leased bytes is returned to the queue (and all of them if the file is closed without a commit)
+// Moving the tail index through the memory mapping commits the leased bytes as well
+#define LITECHR_IOC_COMMIT              _IOW(LITECHR_IOC_MAGIC, 10, __u32)
+// Open a new file descriptor (with O_CLOEXEC, O_NONBLOCK taken from the calling file) using the queue of a numbered channel,
+// the channel is created by the first file and removed when the last file using it is closed
+// Unrelated processes agreeing on a number share the channel queue, which is separate from the shared one
+// Returns the new file descriptor
+#define LITECHR_IOC_OPEN_CHANNEL        _IOW(LITECHR_IOC_MAGIC, 11, __u32)
@@ -0,0 +1,691 @@
+// KUnit suites of the file context queue and the open modes of the driver
+// The file is linked into the driver when CONFIG_LITECHR_KUNIT_TEST is enabled, which also makes the driver state
+// the tests reach visible (see litechr.h). The suites run once the driver is initialized (at boot or module load).
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <kunit/test.h>
+#include <kunit/visibility.h>
+
+#include "context.h"
+#include "litechr.h"
+#include "litechr_ioctl.h"
+
+// Queue size of the tested contexts
+#define KUNIT_QUEUE_SIZE        1000
+// Number of bytes every producer thread writes
+#define KUNIT_THREAD_BYTES      (256 * 1024)
+// Longest write or read of a thread
+#define KUNIT_THREAD_CHUNK      97
+// Time the threads of a test are given to move their bytes
+#define KUNIT_THREAD_TIMEOUT    (30 * HZ)
+
+// State shared by the producer and consumer threads of a test
+struct litechr_kunit_threads {
+    struct file_context *pfile_ctx;
+    // Number of producer threads (a single producer must be read in order)
+    unsigned int producers;
+    // Bytes still to be read by all the consumers
+    atomic_t left;
+    // Sum of the bytes read
+    atomic64_t sum;
+    // Set when a consumer read bytes out of order
+    bool disordered;
+    // Set when the threads have to give up
+    bool stop;
+    // Completed by every thread when it ends
+    struct completion done;
+};
+
+// Byte a producer writes at the offset of its stream
+static inline char litechr_kunit_byte(unsigned int offset)
+{
+    return offset % 251;
+}
+
+// Create a private file context for a test
+static struct file_context* litechr_kunit_context(struct kunit *test, size_t size)
+{
+    struct file_context *pfile_ctx = kunit_kzalloc(test, sizeof(struct file_context), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfile_ctx);
+    KUNIT_ASSERT_EQ(test, file_context_init(pfile_ctx, size, false, 0, NULL), 0);
+    return pfile_ctx;
+}
+
+// Written bytes are read back in order, also when they wrap around the end of the ring
+static void litechr_kunit_write_read(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+    char in[300], out[300];
+    unsigned int i, round;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = litechr_kunit_byte(i);
+    // Enough rounds for the indexes to cross the end of the ring several times
+    for (round = 0; round < 3 * PAGE_SIZE / sizeof(in); round++) {
+        KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, in, sizeof(in)), sizeof(in));
+        KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), sizeof(in));
+        memset(out, 0, sizeof(out));
+        KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out)), sizeof(out));
+        KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+    }
+    KUNIT_EXPECT_FALSE(test, file_context_readable(pfile_ctx));
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Writes stop at the queue size and reads at the stored bytes
+static void litechr_kunit_limits(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+    static char buf[2 * KUNIT_QUEUE_SIZE];
+
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, buf, sizeof(buf)), KUNIT_QUEUE_SIZE);
+    KUNIT_EXPECT_EQ(test, file_context_space(pfile_ctx), 0);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, buf, 1), 0);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, buf, sizeof(buf)), KUNIT_QUEUE_SIZE);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, buf, sizeof(buf)), 0);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Records are read one at a time and truncated to the read length
+static void litechr_kunit_records(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+    char in[] = "0123456789", out[sizeof(in)];
+    struct kvec kvec;
+    struct iov_iter iter;
+
+    KUNIT_ASSERT_EQ(test, file_context_flags_set(pfile_ctx, LITECHR_CTX_RECORDS), 0);
+    kvec.iov_base = in;
+    kvec.iov_len = 4;
+    iov_iter_kvec(&iter, WRITE, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_iter(pfile_ctx, &pfile_ctx->data_queue, &iter, false), 4);
+    kvec.iov_base = in + 4;
+    kvec.iov_len = 6;
+    iov_iter_kvec(&iter, WRITE, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_iter(pfile_ctx, &pfile_ctx->data_queue, &iter, false), 6);
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 10 + 2 * LITECHR_RECORD_HEADER_SIZE);
+
+    KUNIT_EXPECT_EQ(test, file_context_read_size(pfile_ctx), 4);
+    kvec.iov_base = out;
+    kvec.iov_len = sizeof(out);
+    iov_iter_kvec(&iter, READ, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_iter(pfile_ctx, &iter), 4);
+    KUNIT_EXPECT_EQ(test, memcmp(out, in, 4), 0);
+    // The rest of a truncated record is dropped
+    kvec.iov_len = 2;
+    iov_iter_kvec(&iter, READ, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_iter(pfile_ctx, &iter), 2);
+    KUNIT_EXPECT_EQ(test, memcmp(out, in + 4, 2), 0);
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 0);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// The storage is allocated once by the context, writes and reads of any size never allocate
+static void litechr_kunit_no_alloc(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+    struct page **pages = pfile_ctx->data_queue.pages;
+    unsigned int nr_pages = pfile_ctx->data_queue.nr_pages;
+    char *pbuf = pfile_ctx->data_queue.buf;
+    static char buf[KUNIT_QUEUE_SIZE];
+    size_t length;
+
+    for (length = 1; length <= KUNIT_QUEUE_SIZE; length++) {
+        file_context_data_queue_write_from_buffer(pfile_ctx, buf, length);
+        file_context_data_queue_read_to_buffer(pfile_ctx, buf, length / 2 + 1);
+    }
+    KUNIT_EXPECT_PTR_EQ(test, pfile_ctx->data_queue.pages, pages);
+    KUNIT_EXPECT_EQ(test, pfile_ctx->data_queue.nr_pages, nr_pages);
+    KUNIT_EXPECT_PTR_EQ(test, pfile_ctx->data_queue.buf, pbuf);
+    // Queue sizes are rounded to whole pages, not to the stored bytes
+    KUNIT_EXPECT_EQ(test, nr_pages, 1 + (unsigned int)(pfile_ctx->data_queue.capacity >> PAGE_SHIFT));
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Clearing only moves the read index, so its cost does not depend on the number of stored bytes
+static void litechr_kunit_clear(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, 4 * PAGE_SIZE);
+    struct data_queue *pqueue = &pfile_ctx->data_queue;
+    char *pbuf = kunit_kmalloc(test, pqueue->limit, GFP_KERNEL);
+    unsigned int head;
+    size_t i;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pbuf);
+    for (i = 0; i < pqueue->limit; i++)
+        pbuf[i] = litechr_kunit_byte(i);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, pbuf, pqueue->limit), pqueue->limit);
+    head = pqueue->phdr->head;
+    file_context_data_queue_clear(pfile_ctx);
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 0);
+    KUNIT_EXPECT_EQ(test, pqueue->phdr->head, head);
+    KUNIT_EXPECT_EQ(test, pqueue->phdr->tail, head);
+    // None of the dropped bytes were touched
+    for (i = 0; i < pqueue->limit; i++)
+        if (pqueue->buf[i] != litechr_kunit_byte(i))
+            break;
+    KUNIT_EXPECT_EQ(test, i, pqueue->limit);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// A chunk numbered before a clear of a strictly ordered sharded context but published after it is dropped
+static void litechr_kunit_shards_clear(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+    char stale[] = "stale", fresh[] = "fresh", out[sizeof(stale) + sizeof(fresh)];
+    struct kvec kvec;
+    struct iov_iter iter;
+
+    KUNIT_ASSERT_EQ(test, file_context_shards_init(pfile_ctx, KUNIT_QUEUE_SIZE, true), 0);
+    file_context_data_queue_clear(pfile_ctx);
+    kvec = (struct kvec){stale, sizeof(stale)};
+    iov_iter_kvec(&iter, WRITE, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_iter(pfile_ctx, &pfile_ctx->shards.queues[0], &iter, false),
+        sizeof(stale));
+    // The chunk took its number before the clear, which is only published now
+    pfile_ctx->shards.next_seq = atomic64_read(&pfile_ctx->shards.seq);
+    kvec = (struct kvec){fresh, sizeof(fresh)};
+    iov_iter_kvec(&iter, WRITE, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_iter(pfile_ctx, &pfile_ctx->shards.queues[1 % pfile_ctx->shards.count],
+        &iter, false), sizeof(fresh));
+
+    kvec = (struct kvec){out, sizeof(out)};
+    iov_iter_kvec(&iter, READ, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_iter(pfile_ctx, &iter), sizeof(fresh));
+    KUNIT_EXPECT_EQ(test, memcmp(out, fresh, sizeof(fresh)), 0);
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 0);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Lazily allocated data pages are allocated by the first write and freed again while the queue is empty and unmapped
+static void litechr_kunit_lazy_storage(struct kunit *test)
+{
+    struct file_context *pfile_ctx = kunit_kzalloc(test, sizeof(struct file_context), GFP_KERNEL);
+    char in[] = "data", out[sizeof(in)];
+    struct kvec kvec = {in, sizeof(in)};
+    struct iov_iter iter;
+    size_t memory;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfile_ctx);
+    KUNIT_ASSERT_EQ(test, file_context_init(pfile_ctx, KUNIT_QUEUE_SIZE, false, 1000, NULL), 0);
+    KUNIT_EXPECT_NULL(test, pfile_ctx->data_queue.buf);
+    memory = file_context_memory(pfile_ctx);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out)), 0);
+    // A nowait write does not allocate the pages
+    iov_iter_kvec(&iter, WRITE, &kvec, 1, kvec.iov_len);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_iter(pfile_ctx, &pfile_ctx->data_queue, &iter, true), -EAGAIN);
+    KUNIT_EXPECT_NULL(test, pfile_ctx->data_queue.buf);
+
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, in, sizeof(in)), sizeof(in));
+    KUNIT_EXPECT_NOT_NULL(test, pfile_ctx->data_queue.buf);
+    KUNIT_EXPECT_EQ(test, file_context_memory(pfile_ctx), memory + pfile_ctx->data_queue.capacity);
+    // Stored data and mappings keep the pages
+    KUNIT_EXPECT_FALSE(test, file_context_storage_reclaim(pfile_ctx));
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out)), sizeof(out));
+    atomic_inc(&pfile_ctx->data_queue.mmap_count);
+    KUNIT_EXPECT_FALSE(test, file_context_storage_reclaim(pfile_ctx));
+    atomic_dec(&pfile_ctx->data_queue.mmap_count);
+    KUNIT_EXPECT_TRUE(test, file_context_storage_reclaim(pfile_ctx));
+    KUNIT_EXPECT_NULL(test, pfile_ctx->data_queue.buf);
+    KUNIT_EXPECT_EQ(test, file_context_memory(pfile_ctx), memory);
+
+    // Indexes changed through a mapping of the header alone leave the queue without pages empty
+    pfile_ctx->data_queue.phdr->head = pfile_ctx->data_queue.phdr->tail + 100;
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 0);
+    KUNIT_EXPECT_FALSE(test, file_context_readable(pfile_ctx));
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out)), 0);
+
+    // The next write allocates the pages and drops the bogus indexes
+    memset(out, 0, sizeof(out));
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, in, sizeof(in)), sizeof(in));
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out)), sizeof(out));
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Data pages are only allocated while they fit the budget shared by the contexts
+static void litechr_kunit_budget(struct kunit *test)
+{
+    struct file_context *pfile_ctx = kunit_kzalloc(test, sizeof(struct file_context), GFP_KERNEL);
+    struct file_context *plazy_file_ctx = kunit_kzalloc(test, sizeof(struct file_context), GFP_KERNEL);
+    struct file_context_budget budget;
+    char in[] = "data";
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfile_ctx);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, plazy_file_ctx);
+    KUNIT_ASSERT_EQ(test, file_context_budget_init(&budget, 2 * PAGE_SIZE), 0);
+    KUNIT_ASSERT_EQ(test, file_context_init(pfile_ctx, PAGE_SIZE, false, 0, &budget), 0);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), PAGE_SIZE);
+    KUNIT_ASSERT_EQ(test, file_context_init(plazy_file_ctx, PAGE_SIZE, false, 1000, &budget), 0);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), PAGE_SIZE);
+
+    // Neither a larger ring nor the pages of another context fit while the first ring is allocated
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_resize(pfile_ctx, 2 * PAGE_SIZE), -ENOBUFS);
+    KUNIT_EXPECT_EQ(test, pfile_ctx->data_queue.limit, PAGE_SIZE);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(plazy_file_ctx, in, sizeof(in)), sizeof(in));
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), 2 * PAGE_SIZE);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_resize(plazy_file_ctx, 2 * PAGE_SIZE), -ENOBUFS);
+
+    // Freed pages return to the budget
+    file_context_data_queue_clear(plazy_file_ctx);
+    KUNIT_EXPECT_TRUE(test, file_context_storage_reclaim(plazy_file_ctx));
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), PAGE_SIZE);
+    file_context_remove(NULL, NULL, pfile_ctx);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), 0);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_resize(plazy_file_ctx, 2 * PAGE_SIZE), 0);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(plazy_file_ctx, in, sizeof(in)), sizeof(in));
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), 2 * PAGE_SIZE);
+    file_context_remove(NULL, NULL, plazy_file_ctx);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), 0);
+    file_context_budget_destroy(&budget);
+}
+
+// Resizing keeps the stored bytes and refuses to drop them
+static void litechr_kunit_resize(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+    char in[600], out[600];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = litechr_kunit_byte(i);
+    // Store the data across the end of the ring
+    for (i = 0; i < PAGE_SIZE / sizeof(in); i++) {
+        file_context_data_queue_write_from_buffer(pfile_ctx, in, sizeof(in));
+        file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out));
+    }
+    file_context_data_queue_write_from_buffer(pfile_ctx, in, sizeof(in));
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_resize(pfile_ctx, sizeof(in) - 1), -EBUSY);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_resize(pfile_ctx, 3 * PAGE_SIZE), 0);
+    KUNIT_EXPECT_EQ(test, pfile_ctx->data_queue.limit, 3 * PAGE_SIZE);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_read_to_buffer(pfile_ctx, out, sizeof(out)), sizeof(out));
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Removed contexts are reused from the pool and the registry limits the number of contexts
+static void litechr_kunit_pool(struct kunit *test)
+{
+    struct file_context_pool pool;
+    struct file_context *pfile_ctx, *pother_file_ctx;
+    struct xarray file_ctxs;
+
+    xa_init_flags(&file_ctxs, XA_FLAGS_ALLOC);
+    KUNIT_ASSERT_EQ(test, file_context_pool_init(&pool, KUNIT_QUEUE_SIZE, 1, false, 0, NULL), 0);
+
+    pfile_ctx = file_context_add(&pool, &file_ctxs, 2);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfile_ctx);
+    KUNIT_EXPECT_EQ(test, pfile_ctx->id, 1);
+    KUNIT_EXPECT_PTR_EQ(test, xa_load(&file_ctxs, 1), (void *)pfile_ctx);
+    // Index 0 is taken by the shared context, so a limit of 2 leaves room for a single context
+    KUNIT_EXPECT_EQ(test, PTR_ERR(file_context_add(&pool, &file_ctxs, 2)), -EBUSY);
+
+    file_context_data_queue_write_from_buffer(pfile_ctx, "data", 4);
+    file_context_remove(&pool, &file_ctxs, pfile_ctx);
+    KUNIT_EXPECT_NULL(test, xa_load(&file_ctxs, 1));
+    KUNIT_EXPECT_EQ(test, pool.count, 1);
+
+    // The context is reused but its data pages are not, they were freed when it entered the pool
+    KUNIT_EXPECT_NULL(test, pfile_ctx->data_queue.buf);
+    pother_file_ctx = file_context_add(&pool, &file_ctxs, 2);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pother_file_ctx);
+    KUNIT_EXPECT_PTR_EQ(test, pother_file_ctx, pfile_ctx);
+    KUNIT_EXPECT_EQ(test, pool.hits, 1);
+    KUNIT_EXPECT_EQ(test, pool.misses, 1);
+    KUNIT_EXPECT_EQ(test, file_context_size(pother_file_ctx), 0);
+    KUNIT_EXPECT_NULL(test, pother_file_ctx->data_queue.buf);
+
+    file_context_remove(&pool, &file_ctxs, pother_file_ctx);
+    KUNIT_EXPECT_EQ(test, pool.count, 1);
+
+    // A context taken from the pool goes back to it when the registry is full
+    KUNIT_ASSERT_EQ(test, xa_insert(&file_ctxs, 1, &pool, GFP_KERNEL), 0);
+    KUNIT_EXPECT_EQ(test, PTR_ERR(file_context_add(&pool, &file_ctxs, 2)), -EBUSY);
+    KUNIT_EXPECT_EQ(test, pool.hits, 2);
+    KUNIT_EXPECT_EQ(test, pool.count, 1);
+    KUNIT_EXPECT_EQ(test, pool.drops, 0);
+    xa_erase(&file_ctxs, 1);
+
+    file_context_pool_destroy(&pool);
+    xa_destroy(&file_ctxs);
+}
+
+// Pooled contexts give their data pages back to the budget and the next owner allocates them by its first write
+static void litechr_kunit_pool_budget(struct kunit *test)
+{
+    struct file_context_pool pool;
+    struct file_context_budget budget;
+    struct file_context *pfile_ctx;
+    struct xarray file_ctxs;
+
+    xa_init_flags(&file_ctxs, XA_FLAGS_ALLOC);
+    KUNIT_ASSERT_EQ(test, file_context_budget_init(&budget, PAGE_SIZE), 0);
+    KUNIT_ASSERT_EQ(test, file_context_pool_init(&pool, KUNIT_QUEUE_SIZE, 1, false, 0, &budget), 0);
+
+    pfile_ctx = file_context_add(&pool, &file_ctxs, 2);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfile_ctx);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), PAGE_SIZE);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, "data", 4), 4);
+    file_context_remove(&pool, &file_ctxs, pfile_ctx);
+    KUNIT_EXPECT_EQ(test, pool.count, 1);
+    KUNIT_EXPECT_NULL(test, pfile_ctx->data_queue.buf);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), 0);
+
+    KUNIT_ASSERT_PTR_EQ(test, file_context_add(&pool, &file_ctxs, 2), pfile_ctx);
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 0);
+    KUNIT_EXPECT_EQ(test, file_context_data_queue_write_from_buffer(pfile_ctx, "data", 4), 4);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), PAGE_SIZE);
+
+    file_context_remove(&pool, &file_ctxs, pfile_ctx);
+    file_context_pool_destroy(&pool);
+    KUNIT_EXPECT_EQ(test, file_context_budget_used(&budget), 0);
+    file_context_budget_destroy(&budget);
+    xa_destroy(&file_ctxs);
+}
+
+// Producer thread writing its stream of bytes in chunks of varying length
+static int litechr_kunit_producer(void *pdata)
+{
+    struct litechr_kunit_threads *pthreads = pdata;
+    struct file_context *pfile_ctx = pthreads->pfile_ctx;
+    char chunk[KUNIT_THREAD_CHUNK];
+    unsigned int offset = 0, length, i;
+    struct data_queue *pqueue;
+    size_t written;
+
+    while (offset < KUNIT_THREAD_BYTES && !READ_ONCE(pthreads->stop)) {
+        length = min_t(unsigned int, KUNIT_THREAD_BYTES - offset, 1 + offset % KUNIT_THREAD_CHUNK);
+        for (i = 0; i < length; i++)
+            chunk[i] = litechr_kunit_byte(offset + i);
+        pqueue = file_context_lock_writer(pfile_ctx, false);
+        if (IS_ERR(pqueue))
+            break;
+        written = file_context_data_queue_write_from_buffer(pfile_ctx, chunk, length);
+        data_queue_unlock_writer(pqueue);
+        // The rest of the chunk is built again by the next write
+        offset += written;
+        if (written == 0)
+            cond_resched();
+    }
+    complete(&pthreads->done);
+    return 0;
+}
+
+// Consumer thread reading until all the written bytes are read
+static int litechr_kunit_consumer(void *pdata)
+{
+    struct litechr_kunit_threads *pthreads = pdata;
+    struct file_context *pfile_ctx = pthreads->pfile_ctx;
+    char chunk[KUNIT_THREAD_CHUNK];
+    unsigned int offset = 0, i;
+    size_t length;
+    u64 sum;
+
+    while (atomic_read(&pthreads->left) > 0 && !READ_ONCE(pthreads->stop)) {
+        if (file_context_lock_reader(pfile_ctx, false))
+            break;
+        length = file_context_data_queue_read_to_buffer(pfile_ctx, chunk, sizeof(chunk));
+        file_context_unlock_reader(pfile_ctx);
+        if (length == 0) {
+            cond_resched();
+            continue;
+        }
+        sum = 0;
+        for (i = 0; i < length; i++) {
+            // The stream of a single producer is read in order
+            if (pthreads->producers == 1 && chunk[i] != litechr_kunit_byte(offset + i))
+                WRITE_ONCE(pthreads->disordered, true);
+            sum += (u8)chunk[i];
+        }
+        offset += length;
+        atomic64_add(sum, &pthreads->sum);
+        atomic_sub(length, &pthreads->left);
+    }
+    complete(&pthreads->done);
+    return 0;
+}
+
+// Run producer and consumer kthreads on a context and check that every written byte is read once
+static void litechr_kunit_threads_run(struct kunit *test, struct file_context *pfile_ctx, unsigned int producers,
+    unsigned int consumers)
+{
+    struct litechr_kunit_threads *pthreads = kunit_kzalloc(test, sizeof(struct litechr_kunit_threads), GFP_KERNEL);
+    struct task_struct *ptask;
+    unsigned int i, started = 0;
+    u64 sum = 0;
+    bool timeout = false;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pthreads);
+    pthreads->pfile_ctx = pfile_ctx;
+    pthreads->producers = producers;
+    atomic_set(&pthreads->left, producers * KUNIT_THREAD_BYTES);
+    atomic64_set(&pthreads->sum, 0);
+    init_completion(&pthreads->done);
+
+    for (i = 0; i < producers + consumers; i++) {
+        ptask = kthread_run(i < producers ? litechr_kunit_producer : litechr_kunit_consumer, pthreads,
+            "litechr_kunit/%u", i);
+        if (IS_ERR(ptask))
+            break;
+        started++;
+    }
+    // Threads have to end before their state is freed, even if the test fails
+    if (started < producers + consumers)
+        WRITE_ONCE(pthreads->stop, true);
+    for (i = 0; i < started; i++) {
+        if (!timeout && !wait_for_completion_timeout(&pthreads->done, KUNIT_THREAD_TIMEOUT)) {
+            timeout = true;
+            WRITE_ONCE(pthreads->stop, true);
+        }
+        if (timeout)
+            wait_for_completion(&pthreads->done);
+    }
+    KUNIT_ASSERT_EQ(test, started, producers + consumers);
+    KUNIT_EXPECT_FALSE(test, timeout);
+
+    for (i = 0; i < KUNIT_THREAD_BYTES; i++)
+        sum += (u8)litechr_kunit_byte(i);
+    KUNIT_EXPECT_EQ(test, atomic_read(&pthreads->left), 0);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&pthreads->sum), producers * sum);
+    KUNIT_EXPECT_FALSE(test, pthreads->disordered);
+    KUNIT_EXPECT_EQ(test, file_context_size(pfile_ctx), 0);
+}
+
+// A single producer and consumer share the ring without excluding each other, like an exclusive or multi mode file
+static void litechr_kunit_threads_spsc(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+
+    pfile_ctx->data_queue.spsc = true;
+    litechr_kunit_threads_run(test, pfile_ctx, 1, 1);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+// Several producers and consumers are serialized by the queue mutex, like shared mode files
+static void litechr_kunit_threads_shared(struct kunit *test)
+{
+    struct file_context *pfile_ctx = litechr_kunit_context(test, KUNIT_QUEUE_SIZE);
+
+    litechr_kunit_threads_run(test, pfile_ctx, 2, 2);
+    file_context_remove(NULL, NULL, pfile_ctx);
+}
+
+static struct kunit_case litechr_kunit_context_cases[] = {
+    KUNIT_CASE(litechr_kunit_write_read),
+    KUNIT_CASE(litechr_kunit_limits),
+    KUNIT_CASE(litechr_kunit_records),
+    KUNIT_CASE(litechr_kunit_no_alloc),
+    KUNIT_CASE(litechr_kunit_clear),
+    KUNIT_CASE(litechr_kunit_shards_clear),
+    KUNIT_CASE(litechr_kunit_lazy_storage),
+    KUNIT_CASE(litechr_kunit_budget),
+    KUNIT_CASE(litechr_kunit_resize),
+    KUNIT_CASE(litechr_kunit_pool),
+    KUNIT_CASE(litechr_kunit_pool_budget),
+    KUNIT_CASE(litechr_kunit_threads_spsc),
+    KUNIT_CASE(litechr_kunit_threads_shared),
+    {}
+};
+
+static struct kunit_suite litechr_kunit_context_suite = {
+    .name = "litechr_context",
+    .test_cases = litechr_kunit_context_cases,
+};
+
+// Open a file of the device with the flags through the driver callback
+// Returns the file or NULL if the open failed (the error is stored to pret)
+static struct file* litechr_kunit_open(struct kunit *test, unsigned int flags, int *pret)
+{
+    struct file *pfile = kunit_kzalloc(test, sizeof(struct file), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfile);
+    pfile->f_flags = flags;
+    *pret = litechr_open(NULL, pfile);
+    return *pret ? NULL : pfile;
+}
+
+// The open modes change the state of the whole device, so they can only be tested while nobody uses it
+static int litechr_kunit_open_init(struct kunit *test)
+{
+    if (atomic_read(&litechr_opened_files_count) != 0)
+        kunit_skip(test, "the device is in use");
+    return 0;
+}
+
+// Shared mode files exclude exclusive mode and the other way around
+static void litechr_kunit_open_exclusive(struct kunit *test)
+{
+    struct file *pshared, *pexclusive;
+    int ret;
+
+    pshared = litechr_kunit_open(test, O_RDWR, &ret);
+    KUNIT_ASSERT_NOT_NULL(test, pshared);
+    KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), 1);
+    KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR | O_EXCL, &ret));
+    KUNIT_EXPECT_EQ(test, ret, -EBUSY);
+    litechr_release(NULL, pshared);
+    KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), 0);
+
+    pexclusive = litechr_kunit_open(test, O_RDWR | O_EXCL, &ret);
+    KUNIT_ASSERT_NOT_NULL(test, pexclusive);
+    KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), OPENED_FILES_EXCLUSIVE);
+    KUNIT_EXPECT_PTR_EQ(test, litechr_file_context_get(pexclusive), &litechr_file_context);
+    KUNIT_EXPECT_TRUE(test, litechr_file_context.data_queue.spsc);
+    KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR, &ret));
+    KUNIT_EXPECT_EQ(test, ret, -EBUSY);
+    KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR | O_CREAT, &ret));
+    KUNIT_EXPECT_EQ(test, ret, -EBUSY);
+    litechr_release(NULL, pexclusive);
+    KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), 0);
+    KUNIT_EXPECT_FALSE(test, litechr_file_context.data_queue.spsc);
+}
+
+// Multi mode files get registered contexts of their own, limited by the registry size
+static void litechr_kunit_open_multi(struct kunit *test)
+{
+    unsigned int max_file_contexts = litechr_max_file_contexts;
+    struct file *pmulti;
+    struct file_context *pfile_ctx;
+    int ret;
+
+    // The shared context takes index 0, so a single multi mode context fits
+    litechr_max_file_contexts = 2;
+    pmulti = litechr_kunit_open(test, O_RDWR | O_CREAT, &ret);
+    if (pmulti) {
+        pfile_ctx = litechr_file_context_get(pmulti);
+        KUNIT_EXPECT_PTR_NE(test, pfile_ctx, &litechr_file_context);
+        KUNIT_EXPECT_TRUE(test, pfile_ctx->data_queue.spsc);
+        KUNIT_EXPECT_PTR_EQ(test, xa_load(&litechr_file_contexts, pfile_ctx->id), (void *)pfile_ctx);
+        KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR | O_CREAT, &ret));
+        KUNIT_EXPECT_EQ(test, ret, -EBUSY);
+        // A rejected open is not counted
+        KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), 1);
+        litechr_release(NULL, pmulti);
+        KUNIT_EXPECT_NULL(test, xa_load(&litechr_file_contexts, pfile_ctx->id));
+    }
+    else
+        KUNIT_FAIL(test, "multi mode open failed with %d", ret);
+    litechr_max_file_contexts = max_file_contexts;
+    KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), 0);
+}
+
+// Opens of any mode are rejected once the opened files limit is reached
+static void litechr_kunit_open_limit(struct kunit *test)
+{
+    unsigned int max_opened_files = litechr_max_opened_files;
+    struct file *pshared;
+    int ret;
+
+    litechr_max_opened_files = 1;
+    pshared = litechr_kunit_open(test, O_RDWR, &ret);
+    if (pshared) {
+        KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR, &ret));
+        KUNIT_EXPECT_EQ(test, ret, -EMFILE);
+        KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR | O_CREAT, &ret));
+        KUNIT_EXPECT_EQ(test, ret, -EMFILE);
+        litechr_release(NULL, pshared);
+    }
+    else
+        KUNIT_FAIL(test, "shared mode open failed with %d", ret);
+    litechr_max_opened_files = 0;
+    KUNIT_EXPECT_NULL(test, litechr_kunit_open(test, O_RDWR | O_EXCL, &ret));
+    KUNIT_EXPECT_EQ(test, ret, -EMFILE);
+    litechr_max_opened_files = max_opened_files;
+    KUNIT_EXPECT_EQ(test, atomic_read(&litechr_opened_files_count), 0);
+}
+
+// Files of a channel share its context, which is removed with the last of them
+static void litechr_kunit_channels(struct kunit *test)
+{
+    struct file_context *pfirst, *psecond, *pother;
+
+    pfirst = litechr_channel_get(7);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pfirst);
+    psecond = litechr_channel_get(7);
+    KUNIT_EXPECT_PTR_EQ(test, psecond, pfirst);
+    KUNIT_EXPECT_EQ(test, pfirst->users, 2);
+    pother = litechr_channel_get(8);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, pother);
+    KUNIT_EXPECT_PTR_NE(test, pother, pfirst);
+
+    litechr_channel_put(psecond);
+    KUNIT_EXPECT_PTR_EQ(test, xa_load(&litechr_channels, 7), (void *)pfirst);
+    litechr_channel_put(pfirst);
+    KUNIT_EXPECT_NULL(test, xa_load(&litechr_channels, 7));
+    if (!IS_ERR_OR_NULL(pother))
+        litechr_channel_put(pother);
+    KUNIT_EXPECT_NULL(test, xa_load(&litechr_channels, 8));
+}
+
+static struct kunit_case litechr_kunit_open_cases[] = {
+    KUNIT_CASE(litechr_kunit_open_exclusive),
+    KUNIT_CASE(litechr_kunit_open_multi),
+    KUNIT_CASE(litechr_kunit_open_limit),
+    KUNIT_CASE(litechr_kunit_channels),
+    {}
+};
+
+static struct kunit_suite litechr_kunit_open_suite = {
+    .name = "litechr_open",
+    .init = litechr_kunit_open_init,
+    .test_cases = litechr_kunit_open_cases,
+};
+
+kunit_test_suites(&litechr_kunit_context_suite, &litechr_kunit_open_suite);
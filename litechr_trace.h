@@ -0,0 +1,152 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM litechr
+
+#if !defined(_LITECHR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LITECHR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Tracepoints of the driver (see /sys/kernel/tracing/events/litechr)
+// Contexts are identified by their registry index (0 for the shared context)
+
+// File opened (or failed to open)
+TRACE_EVENT(litechr_open,
+    TP_PROTO(u32 ctx_id, int mode, int ret),
+    TP_ARGS(ctx_id, mode, ret),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(int, mode)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->mode = mode;
+        __entry->ret = ret;
+    ),
+    TP_printk("ctx=%u mode=%d ret=%d", __entry->ctx_id, __entry->mode, __entry->ret)
+);
+
+// File closed
+TRACE_EVENT(litechr_release,
+    TP_PROTO(u32 ctx_id, int mode),
+    TP_ARGS(ctx_id, mode),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(int, mode)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->mode = mode;
+    ),
+    TP_printk("ctx=%u mode=%d", __entry->ctx_id, __entry->mode)
+);
+
+// Data moved between a file and its context queue
+DECLARE_EVENT_CLASS(litechr_io,
+    TP_PROTO(u32 ctx_id, size_t length, ssize_t ret, size_t size_before, size_t size_after, u64 lock_wait_ns),
+    TP_ARGS(ctx_id, length, ret, size_before, size_after, lock_wait_ns),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(size_t, length)
+        __field(ssize_t, ret)
+        __field(size_t, size_before)
+        __field(size_t, size_after)
+        __field(u64, lock_wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->length = length;
+        __entry->ret = ret;
+        __entry->size_before = size_before;
+        __entry->size_after = size_after;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+    TP_printk("ctx=%u length=%zu ret=%zd size=%zu->%zu lock_wait_ns=%llu",
+        __entry->ctx_id, __entry->length, __entry->ret,
+        __entry->size_before, __entry->size_after, __entry->lock_wait_ns)
+);
+
+// Data read from a context queue (lock_wait_ns is the time spent acquiring the queue lock)
+DEFINE_EVENT(litechr_io, litechr_read,
+    TP_PROTO(u32 ctx_id, size_t length, ssize_t ret, size_t size_before, size_t size_after, u64 lock_wait_ns),
+    TP_ARGS(ctx_id, length, ret, size_before, size_after, lock_wait_ns)
+);
+
+// Data written to a context queue (lock_wait_ns is the time spent acquiring the queue lock)
+DEFINE_EVENT(litechr_io, litechr_write,
+    TP_PROTO(u32 ctx_id, size_t length, ssize_t ret, size_t size_before, size_t size_after, u64 lock_wait_ns),
+    TP_ARGS(ctx_id, length, ret, size_before, size_after, lock_wait_ns)
+);
+
+// Context added (taken from the pool or allocated)
+TRACE_EVENT(litechr_context_add,
+    TP_PROTO(u32 ctx_id, bool pooled),
+    TP_ARGS(ctx_id, pooled),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(bool, pooled)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->pooled = pooled;
+    ),
+    TP_printk("ctx=%u pooled=%d", __entry->ctx_id, __entry->pooled)
+);
+
+// Context removed (returned to the pool or freed)
+TRACE_EVENT(litechr_context_remove,
+    TP_PROTO(u32 ctx_id, bool pooled),
+    TP_ARGS(ctx_id, pooled),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(bool, pooled)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->pooled = pooled;
+    ),
+    TP_printk("ctx=%u pooled=%d", __entry->ctx_id, __entry->pooled)
+);
+
+// Context queue resized
+TRACE_EVENT(litechr_context_resize,
+    TP_PROTO(u32 ctx_id, size_t old_limit, size_t new_limit, int ret),
+    TP_ARGS(ctx_id, old_limit, new_limit, ret),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(size_t, old_limit)
+        __field(size_t, new_limit)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->old_limit = old_limit;
+        __entry->new_limit = new_limit;
+        __entry->ret = ret;
+    ),
+    TP_printk("ctx=%u limit=%zu->%zu ret=%d", __entry->ctx_id, __entry->old_limit, __entry->new_limit, __entry->ret)
+);
+
+// Context queue emptied
+TRACE_EVENT(litechr_context_clear,
+    TP_PROTO(u32 ctx_id, size_t size),
+    TP_ARGS(ctx_id, size),
+    TP_STRUCT__entry(
+        __field(u32, ctx_id)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->ctx_id = ctx_id;
+        __entry->size = size;
+    ),
+    TP_printk("ctx=%u dropped=%zu", __entry->ctx_id, __entry->size)
+);
+
+#endif
+
+// This part must be outside the header guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE litechr_trace
+#include <trace/define_trace.h>
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,12 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "litechr_ioctl.h"
 
 #define RETURN_ON_ERROR(expr)           {int res; res = expr; if (res < 0) return res;}
 #define RETURN_ON_ERROR_THREAD(expr)    {int res; res = expr; if (res < 0) pthread_exit((void*)(long)res);}
@@ -22,7 +29,11 @@
 #define MULTI_BUF_SIZE              DEVICE_BUF_SIZE
 #define MULTI_THREADS_COUNT         500
 #define LARGE_FILE_NAME             "litechrdrv.ko"
-#define LARGE_FILE_THREAD_DELAY_US  500
+#define BLOCKING_WRITE_DELAY_US     100000
+#define MULTI_REUSE_COUNT           10
+// Longer than two idle checks of the default storage_idle_ms module parameter (1 s)
+#define IDLE_STORAGE_DELAY_US       2500000
+#define STATS_FILE_NAME             "/sys/kernel/debug/litechr/stats"
 
 struct stat large_file_st; 
 
@@ -62,6 +73,17 @@ int open_multi(void)
     return fd;
 }
 
+int set_nonblocking(int fd)
+{
+    int flags;
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        printf("fcntl: errno=%d\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
 int test_write(int fd, char *buf, size_t size)
 {
     int res;
@@ -117,6 +139,7 @@ int clear_device_buffer(void)
     printf("\nClearing device buffer\n\n"); 
 
     RETURN_ON_ERROR(fd = open_exclusive());
+    RETURN_ON_ERROR(set_nonblocking(fd));
     RETURN_ON_ERROR(test_read(fd, rbuf, DEVICE_BUF_SIZE));
     close(fd);
 
@@ -148,6 +171,8 @@ int test_shared(void)
         RETURN_ON_ERROR(test_read(fd[i], rbuf, TEST_SIZE));
         RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
     }
+    // Empty queue read should not block in non-blocking mode
+    RETURN_ON_ERROR(set_nonblocking(fd[SHARED_FILES_COUNT-1]));
     if (test_read(fd[SHARED_FILES_COUNT-1], rbuf, TEST_SIZE) < 0) {
         printf("Error: should not read! \n");
         return -1;
@@ -331,6 +356,7 @@ int test_large_shared(void)
     struct stat large_file_st; 
     char *wbuf, *rbuf;
     int fd, large_filed;
+    unsigned int size;
     int res;
 
     printf("\nLarge file in shared mode test\n\n"); 
@@ -370,6 +396,14 @@ int test_large_shared(void)
         free(rbuf);
         return fd;
     }
+    // Make the queue large enough for the whole file
+    size = large_file_st.st_size;
+    if ((res = ioctl(fd, LITECHR_IOC_SET_SIZE, &size)) < 0) {
+        printf("Resizing: errno=%d\n", errno);
+        free(wbuf);
+        free(rbuf);
+        return res;
+    }
     if ((res = test_write(fd, wbuf, large_file_st.st_size)) < 0) {
         free(wbuf);
         free(rbuf);
@@ -386,6 +420,13 @@ int test_large_shared(void)
         free(rbuf);
         return res;
     }
+    size = DEVICE_BUF_SIZE;
+    if ((res = ioctl(fd, LITECHR_IOC_SET_SIZE, &size)) < 0) {
+        printf("Resizing: errno=%d\n", errno);
+        free(wbuf);
+        free(rbuf);
+        return res;
+    }
     close(fd);
         
     free(wbuf);
@@ -404,7 +445,6 @@ void *test_large_write_thread_fn(void *wbuf)
     RETURN_ON_ERROR_THREAD(fd = open_shared());
     for (i = 0; i < large_file_st.st_size; i++) {
         RETURN_ON_ERROR_THREAD(test_write(fd, wbuf + i, 1));
-        usleep(LARGE_FILE_THREAD_DELAY_US);
     }
     close(fd);
     
@@ -427,18 +467,12 @@ void *test_large_read_thread_fn(void *wbuf)
             fflush(stdout);
             p = pn;
         }
-        usleep(LARGE_FILE_THREAD_DELAY_US);
+        // The read blocks until the writer thread provides the next byte
         res = test_read(fd, &el, 1);
         if (res < 0)
             pthread_exit((void*)(long)res);
-        if (res == 0) {
-            usleep(LARGE_FILE_THREAD_DELAY_US);
-            res = test_read(fd, &el, 1);
-            if (res < 0)
-                pthread_exit((void*)(long)res);
-            if (res == 0)
-                pthread_exit((void*)(long)-1);
-        }
+        if (res == 0)
+            pthread_exit((void*)(long)-1);
         RETURN_ON_ERROR_THREAD(compare_buffers(wbuf + i, &el, 1));
     }
     printf("\rTest progress: 100%%\n");
@@ -535,6 +569,785 @@ int test_large_shared_threads(void)
     return 0;
 }
 
+void *blocking_read_thread_fn(void *rbuf)
+{
+    int fd;
+
+    // The reader is started on an empty queue and should sleep until data arrives
+    RETURN_ON_ERROR_THREAD(fd = open_shared());
+    RETURN_ON_ERROR_THREAD(test_read(fd, rbuf, TEST_SIZE));
+    close(fd);
+
+    pthread_exit(NULL);
+}
+
+int test_blocking(void)
+{
+    char wbuf[DEVICE_BUF_SIZE] = TEST_STRING;
+    char rbuf[SHARED_BUF_SIZE] = {0};
+    struct pollfd pfd;
+    pthread_t thread_reader;
+    long tres;
+    int fd, res;
+
+    printf("\nBlocking mode and poll test\n\n");
+
+    RETURN_ON_ERROR(fd = open_shared());
+
+    // Empty queue can only be written
+    pfd.fd = fd;
+    pfd.events = POLLIN | POLLOUT;
+    if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLOUT) {
+        printf("Error: empty queue poll events 0x%X\n", pfd.revents);
+        return -1;
+    }
+
+    res = pthread_create(&thread_reader, NULL, blocking_read_thread_fn, (void *)rbuf);
+    if (res != 0) {
+        printf("pthread_create thread_reader: error %d\n", res);
+        return -1;
+    }
+    usleep(BLOCKING_WRITE_DELAY_US);
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    res = pthread_join(thread_reader, (void*)&tres);
+    if (res != 0 || tres < 0) {
+        printf("Reader thread failed\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+
+    // Full queue can only be read
+    RETURN_ON_ERROR(test_write(fd, wbuf, DEVICE_BUF_SIZE));
+    pfd.events = POLLIN | POLLOUT;
+    if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLIN) {
+        printf("Error: full queue poll events 0x%X\n", pfd.revents);
+        return -1;
+    }
+    // Non-blocking write to the full queue is rejected
+    RETURN_ON_ERROR(set_nonblocking(fd));
+    if (write(fd, wbuf, 1) >= 0 || errno != ENOBUFS) {
+        printf("Error: should not write!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd, wbuf, DEVICE_BUF_SIZE));
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_partial_write(void)
+{
+    char wbuf[DEVICE_BUF_SIZE + TEST_SIZE];
+    char rbuf[DEVICE_BUF_SIZE] = {0};
+    unsigned int flags = LITECHR_FILE_PARTIAL_WRITE;
+    int fd, written;
+
+    printf("\nPartial write mode test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+    // The whole buffer does not fit
+    if (write(fd, wbuf, sizeof wbuf) >= 0 || errno != ENOBUFS) {
+        printf("Error: should not write!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_SET_FLAGS, &flags));
+    flags = 0;
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_GET_FLAGS, &flags));
+    if (flags != LITECHR_FILE_PARTIAL_WRITE) {
+        printf("Error: flags 0x%X\n", flags);
+        return -1;
+    }
+    // Only the part that fits is written
+    RETURN_ON_ERROR(written = test_write(fd, wbuf, sizeof wbuf));
+    if (written != DEVICE_BUF_SIZE) {
+        printf("Error: written %d bytes\n", written);
+        return -1;
+    }
+    RETURN_ON_ERROR(set_nonblocking(fd));
+    if (write(fd, wbuf, 1) >= 0 || errno != EAGAIN) {
+        printf("Error: should not write!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd, rbuf, DEVICE_BUF_SIZE));
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, DEVICE_BUF_SIZE));
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_records(void)
+{
+    char wbuf[DEVICE_BUF_SIZE];
+    char rbuf[DEVICE_BUF_SIZE] = {0};
+    unsigned int flags = LITECHR_CTX_RECORDS;
+    size_t sizes[] = {1, TEST_SIZE, 100};
+    int fd, read_size, i;
+
+    printf("\nRecord mode test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+    RETURN_ON_ERROR(set_nonblocking(fd));
+    // The mode can not be changed while the context holds data
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    if (ioctl(fd, LITECHR_IOC_SET_CTX_FLAGS, &flags) >= 0 || errno != EBUSY) {
+        printf("Error: record mode set for a non-empty context!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_SET_CTX_FLAGS, &flags));
+    flags = 0;
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_GET_CTX_FLAGS, &flags));
+    if (flags != LITECHR_CTX_RECORDS) {
+        printf("Error: context flags 0x%X\n", flags);
+        return -1;
+    }
+
+    // Every read returns exactly one record
+    for (i = 0; i < 3; i++)
+        RETURN_ON_ERROR(test_write(fd, wbuf + i, sizes[i]));
+    for (i = 0; i < 3; i++) {
+        RETURN_ON_ERROR(read_size = test_read(fd, rbuf, sizeof rbuf));
+        if (read_size != sizes[i]) {
+            printf("Error: read %d bytes of %zu byte record\n", read_size, sizes[i]);
+            return -1;
+        }
+        RETURN_ON_ERROR(compare_buffers(wbuf + i, rbuf, sizes[i]));
+    }
+
+    // The rest of a record that does not fit the read buffer is dropped
+    RETURN_ON_ERROR(test_write(fd, wbuf, 100));
+    RETURN_ON_ERROR(test_write(fd, wbuf + 1, TEST_SIZE));
+    RETURN_ON_ERROR(read_size = test_read(fd, rbuf, 10));
+    if (read_size != 10) {
+        printf("Error: read %d bytes of truncated record\n", read_size);
+        return -1;
+    }
+    RETURN_ON_ERROR(read_size = test_read(fd, rbuf, sizeof rbuf));
+    if (read_size != TEST_SIZE) {
+        printf("Error: read %d bytes after truncated record\n", read_size);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf + 1, rbuf, TEST_SIZE));
+
+    // A record larger than the queue (along with its header) never fits
+    if (write(fd, wbuf, DEVICE_BUF_SIZE) >= 0 || errno != EMSGSIZE) {
+        printf("Error: should not write!\n");
+        return -1;
+    }
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_vectored(void)
+{
+    char wbuf[3 * TEST_SIZE];
+    char rbuf[3 * TEST_SIZE] = {0};
+    unsigned int flags = LITECHR_CTX_RECORDS;
+    struct iovec wiov[3], riov[2];
+    ssize_t size;
+    int fd, i;
+
+    printf("\nVectored read/write test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+    for (i = 0; i < 3; i++) {
+        wiov[i].iov_base = wbuf + i * TEST_SIZE;
+        wiov[i].iov_len = TEST_SIZE;
+    }
+    riov[0].iov_base = rbuf;
+    riov[0].iov_len = 1;
+    riov[1].iov_base = rbuf + 1;
+    riov[1].iov_len = sizeof rbuf - 1;
+
+    RETURN_ON_ERROR(fd = open_multi());
+    // All buffers are moved by a single call
+    if ((size = writev(fd, wiov, 3)) != sizeof wbuf) {
+        printf("Error: writev res=%zd, error %d\n", size, errno);
+        return -1;
+    }
+    if ((size = readv(fd, riov, 2)) != sizeof rbuf) {
+        printf("Error: readv res=%zd, error %d\n", size, errno);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, sizeof wbuf));
+
+    // In record mode all buffers of a write make a single record
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_SET_CTX_FLAGS, &flags));
+    if ((size = writev(fd, wiov, 3)) != sizeof wbuf) {
+        printf("Error: writev res=%zd, error %d\n", size, errno);
+        return -1;
+    }
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    memset(rbuf, 0, sizeof rbuf);
+    if ((size = readv(fd, riov, 2)) != sizeof rbuf) {
+        printf("Error: readv res=%zd, error %d\n", size, errno);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, sizeof wbuf));
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_splice(void)
+{
+    char wbuf[DEVICE_BUF_SIZE * 2];
+    char rbuf[DEVICE_BUF_SIZE * 2] = {0};
+    int pipe_in[2], pipe_out[2];
+    ssize_t size, moved = 0;
+    int fd;
+
+    printf("\nSplice test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+    RETURN_ON_ERROR(pipe(pipe_in));
+    RETURN_ON_ERROR(pipe(pipe_out));
+
+    // The pipe holds more than the queue, so the data goes through it in parts
+    if (write(pipe_in[1], wbuf, sizeof wbuf) != sizeof wbuf) {
+        printf("Error: pipe write error %d\n", errno);
+        return -1;
+    }
+    while (moved < sizeof wbuf) {
+        size = splice(pipe_in[0], NULL, fd, NULL, sizeof wbuf - moved, 0);
+        if (size <= 0 || size > DEVICE_BUF_SIZE) {
+            printf("Error: splice to device res=%zd, error %d\n", size, errno);
+            return -1;
+        }
+        if (splice(fd, NULL, pipe_out[1], NULL, size, 0) != size) {
+            printf("Error: splice from device error %d\n", errno);
+            return -1;
+        }
+        moved += size;
+    }
+    if (read(pipe_out[0], rbuf, sizeof rbuf) != sizeof rbuf) {
+        printf("Error: pipe read error %d\n", errno);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, sizeof wbuf));
+
+    close(pipe_in[0]);
+    close(pipe_in[1]);
+    close(pipe_out[0]);
+    close(pipe_out[1]);
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+// Test queued size report and non-destructive peek
+int test_peek(void)
+{
+    char wbuf[TEST_SIZE];
+    char rbuf[TEST_SIZE] = {0};
+    unsigned int flags = LITECHR_CTX_RECORDS;
+    struct litechr_peek peek = {0};
+    int fd, queued, peeked;
+
+    printf("\nPeek test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    // Peeking neither consumes the data nor changes the reported size
+    peek.buf = (unsigned long)rbuf;
+    peek.length = TEST_SIZE / 2;
+    RETURN_ON_ERROR(peeked = ioctl(fd, LITECHR_IOC_PEEK, &peek));
+    RETURN_ON_ERROR(ioctl(fd, FIONREAD, &queued));
+    if (peeked != TEST_SIZE / 2 || queued != TEST_SIZE) {
+        printf("Error: peeked %d bytes, %d bytes queued\n", peeked, queued);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE / 2));
+    memset(rbuf, 0, sizeof rbuf);
+    RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+
+    // In record mode the size of the next record is reported
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_SET_CTX_FLAGS, &flags));
+    RETURN_ON_ERROR(test_write(fd, wbuf, 10));
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    RETURN_ON_ERROR(ioctl(fd, FIONREAD, &queued));
+    peek.length = TEST_SIZE;
+    RETURN_ON_ERROR(peeked = ioctl(fd, LITECHR_IOC_PEEK, &peek));
+    if (queued != 10 || peeked != 10) {
+        printf("Error: peeked %d bytes, %d bytes of record reported\n", peeked, queued);
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(ioctl(fd, FIONREAD, &queued));
+    if (queued != TEST_SIZE) {
+        printf("Error: %d bytes of record reported\n", queued);
+        return -1;
+    }
+
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+// Test two-phase reads with reserve and commit
+int test_reserve(void)
+{
+    char wbuf[TEST_SIZE * 2];
+    char rbuf[TEST_SIZE * 2] = {0};
+    struct litechr_reserve reserve = {0};
+    unsigned int length = 1;
+    int fd[2];
+    int reserved;
+
+    printf("\nReserve and commit test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd[0] = open_shared());
+    RETURN_ON_ERROR(fd[1] = open_shared());
+    RETURN_ON_ERROR(set_nonblocking(fd[1]));
+    RETURN_ON_ERROR(test_write(fd[0], wbuf, sizeof wbuf));
+
+    // Leased bytes are kept from other readers and from the owner until committed
+    reserve.buf = (unsigned long)rbuf;
+    reserve.length = TEST_SIZE;
+    RETURN_ON_ERROR(reserved = ioctl(fd[0], LITECHR_IOC_RESERVE, &reserve));
+    if (reserved != TEST_SIZE) {
+        printf("Error: reserved %d bytes\n", reserved);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+    if (ioctl(fd[1], LITECHR_IOC_RESERVE, &reserve) >= 0 || errno != EBUSY) {
+        printf("Error: reserved leased bytes!\n");
+        return -1;
+    }
+    if (read(fd[0], rbuf, sizeof rbuf) >= 0 || errno != EBUSY) {
+        printf("Error: read with a lease held!\n");
+        return -1;
+    }
+    if (test_read(fd[1], rbuf, sizeof rbuf) != 0) {
+        printf("Error: read leased bytes!\n");
+        return -1;
+    }
+    // Only the committed bytes are removed
+    RETURN_ON_ERROR(ioctl(fd[0], LITECHR_IOC_COMMIT, &length));
+
+    // Bytes leased by a closed file are returned to the queue
+    RETURN_ON_ERROR(ioctl(fd[0], LITECHR_IOC_RESERVE, &reserve));
+    close(fd[0]);
+    memset(rbuf, 0, sizeof rbuf);
+    if (test_read(fd[1], rbuf, sizeof rbuf) != sizeof wbuf - 1) {
+        printf("Error: leased bytes lost!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf + 1, rbuf, sizeof wbuf - 1));
+    close(fd[1]);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+// Test broadcast mode with a cursor per reader
+int test_broadcast(void)
+{
+    char wbuf[DEVICE_BUF_SIZE];
+    char rbuf[DEVICE_BUF_SIZE] = {0};
+    unsigned int flags = LITECHR_CTX_BROADCAST;
+    int fd[3];
+    int i, queued;
+
+    printf("\nBroadcast mode test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    // The last file writes, the others read
+    for (i = 0; i < 3; i++) {
+        RETURN_ON_ERROR(fd[i] = open_shared());
+        RETURN_ON_ERROR(set_nonblocking(fd[i]));
+    }
+    RETURN_ON_ERROR(ioctl(fd[2], LITECHR_IOC_SET_CTX_FLAGS, &flags));
+    // Readers join with their first read
+    for (i = 0; i < 2; i++)
+        RETURN_ON_ERROR(test_read(fd[i], rbuf, TEST_SIZE));
+
+    // Every reader gets all the data
+    RETURN_ON_ERROR(test_write(fd[2], wbuf, TEST_SIZE));
+    RETURN_ON_ERROR(test_write(fd[2], wbuf + TEST_SIZE, TEST_SIZE));
+    for (i = 0; i < 2; i++) {
+        memset(rbuf, 0, sizeof rbuf);
+        if (test_read(fd[i], rbuf, sizeof rbuf) != TEST_SIZE * 2) {
+            printf("Error: reader %d missed data!\n", i);
+            return -1;
+        }
+        RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE * 2));
+        RETURN_ON_ERROR(ioctl(fd[i], FIONREAD, &queued));
+        if (queued != 0) {
+            printf("Error: %d bytes left for reader %d\n", queued, i);
+            return -1;
+        }
+    }
+
+    // The space is held by the slowest reader unless the oldest data may be dropped
+    RETURN_ON_ERROR(test_write(fd[2], wbuf, DEVICE_BUF_SIZE));
+    RETURN_ON_ERROR(test_read(fd[0], rbuf, DEVICE_BUF_SIZE));
+    if (write(fd[2], wbuf, TEST_SIZE) >= 0 || errno != ENOBUFS) {
+        printf("Error: slow reader data overwritten!\n");
+        return -1;
+    }
+    flags |= LITECHR_CTX_BROADCAST_DROP;
+    RETURN_ON_ERROR(ioctl(fd[2], LITECHR_IOC_SET_CTX_FLAGS, &flags));
+    RETURN_ON_ERROR(test_write(fd[2], wbuf, TEST_SIZE));
+    if (read(fd[1], rbuf, sizeof rbuf) >= 0 || errno != EPIPE) {
+        printf("Error: dropped data not reported!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd[1], rbuf, sizeof rbuf));
+    RETURN_ON_ERROR(test_read(fd[0], rbuf, sizeof rbuf));
+
+    flags = 0;
+    RETURN_ON_ERROR(ioctl(fd[2], LITECHR_IOC_SET_CTX_FLAGS, &flags));
+    for (i = 0; i < 3; i++)
+        close(fd[i]);
+
+    // A multi mode context has a single file, so there is nobody to broadcast to
+    RETURN_ON_ERROR(fd[0] = open_multi());
+    flags = LITECHR_CTX_BROADCAST;
+    if (ioctl(fd[0], LITECHR_IOC_SET_CTX_FLAGS, &flags) >= 0 || errno != EINVAL) {
+        printf("Error: broadcast mode set for a multi mode context!\n");
+        return -1;
+    }
+    close(fd[0]);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+// Test resetting latency histogram of a file context
+int test_latency(void)
+{
+    char wbuf[TEST_SIZE];
+    char rbuf[TEST_SIZE] = {0};
+    int fd;
+
+    printf("\nLatency histogram test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+
+    // Histograms are kept only when the driver is loaded with latency_histograms=1
+    if (ioctl(fd, LITECHR_IOC_RESET_LATENCY) < 0) {
+        if (errno != EOPNOTSUPP) {
+            printf("Error: latency reset error %d\n", errno);
+            return -1;
+        }
+        printf("Latency is not measured\n");
+    }
+    // Timestamped data reads back unchanged
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_mmap(void)
+{
+    char wbuf[SHARED_BUF_SIZE] = TEST_STRING;
+    char rbuf[SHARED_BUF_SIZE] = {0};
+    struct litechr_ring_header *phdr;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t map_size;
+    char *pdata;
+    int fd;
+
+    printf("\nMemory mapped ring test\n\n");
+
+    RETURN_ON_ERROR(fd = open_multi());
+
+    // Map the header alone to learn the ring size
+    phdr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (phdr == MAP_FAILED) {
+        printf("mmap: errno=%d\n", errno);
+        return -1;
+    }
+    map_size = page_size + phdr->capacity;
+    if (phdr->limit != DEVICE_BUF_SIZE || phdr->capacity < phdr->limit) {
+        printf("Error: ring capacity %u limit %u\n", phdr->capacity, phdr->limit);
+        return -1;
+    }
+    munmap(phdr, page_size);
+
+    phdr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (phdr == MAP_FAILED) {
+        printf("mmap: errno=%d\n", errno);
+        return -1;
+    }
+    pdata = (char *)phdr + page_size;
+
+    // Data written with write() is visible in the mapping
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    if (__atomic_load_n(&phdr->head, __ATOMIC_ACQUIRE) - phdr->tail != TEST_SIZE) {
+        printf("Error: ring head %u tail %u\n", phdr->head, phdr->tail);
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, pdata + phdr->tail % phdr->capacity, TEST_SIZE));
+    __atomic_store_n(&phdr->tail, phdr->tail + TEST_SIZE, __ATOMIC_RELEASE);
+
+    // Data produced through the mapping can be read with read()
+    memcpy(pdata + phdr->head % phdr->capacity, wbuf, TEST_SIZE);
+    __atomic_store_n(&phdr->head, phdr->head + TEST_SIZE, __ATOMIC_RELEASE);
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_NOTIFY));
+    RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+
+    munmap(phdr, map_size);
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_multi_reuse(void)
+{
+    char wbuf[MULTI_BUF_SIZE];
+    char rbuf[MULTI_BUF_SIZE];
+    struct litechr_ring_header *phdr;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t map_size, i;
+    char *pdata;
+    int fd, n;
+
+    printf("\nMulti mode context reuse test\n\n");
+
+    for (n = 0; n < MULTI_REUSE_COUNT; n++) {
+        RETURN_ON_ERROR(fd = open_multi());
+        RETURN_ON_ERROR(set_nonblocking(fd));
+
+        phdr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (phdr == MAP_FAILED) {
+            printf("mmap: errno=%d\n", errno);
+            return -1;
+        }
+        map_size = page_size + phdr->capacity;
+        munmap(phdr, page_size);
+        phdr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (phdr == MAP_FAILED) {
+            printf("mmap: errno=%d\n", errno);
+            return -1;
+        }
+        pdata = (char *)phdr + page_size;
+
+        // A new file context must not show anything left by a previous one (pooled contexts are reused)
+        if (phdr->head != 0 || phdr->tail != 0 || phdr->limit != DEVICE_BUF_SIZE) {
+            printf("Error: reused ring head %u tail %u limit %u\n", phdr->head, phdr->tail, phdr->limit);
+            return -1;
+        }
+        for (i = 0; i < map_size - page_size; i++) {
+            if (pdata[i]) {
+                printf("Error: reused ring data at %zu\n", i);
+                return -1;
+            }
+        }
+        if (read(fd, rbuf, MULTI_BUF_SIZE) != 0) {
+            printf("Error: reused context is not empty\n");
+            return -1;
+        }
+
+        // Leave the context full of data and with moved indexes
+        fill_test_buf(wbuf, MULTI_BUF_SIZE, n);
+        RETURN_ON_ERROR(test_write(fd, wbuf, MULTI_BUF_SIZE));
+        RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+        memset(pdata, 0xFF, map_size - page_size);
+
+        munmap(phdr, map_size);
+        close(fd);
+    }
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_resize(void)
+{
+    char wbuf[DEVICE_BUF_SIZE * 3];
+    char rbuf[DEVICE_BUF_SIZE * 3] = {0};
+    unsigned int size;
+    int fd;
+
+    printf("\nQueue resize test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_GET_SIZE, &size));
+    if (size != DEVICE_BUF_SIZE) {
+        printf("Error: queue size %u\n", size);
+        return -1;
+    }
+    // Grow the queue keeping its data
+    RETURN_ON_ERROR(test_write(fd, wbuf, DEVICE_BUF_SIZE));
+    size = sizeof wbuf;
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_SET_SIZE, &size));
+    RETURN_ON_ERROR(test_write(fd, wbuf + DEVICE_BUF_SIZE, sizeof wbuf - DEVICE_BUF_SIZE));
+    // The queue can not be shrunk below its data
+    size = DEVICE_BUF_SIZE;
+    if (ioctl(fd, LITECHR_IOC_SET_SIZE, &size) >= 0 || errno != EBUSY) {
+        printf("Error: should not shrink!\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd, rbuf, DEVICE_BUF_SIZE * 2));
+    RETURN_ON_ERROR(ioctl(fd, LITECHR_IOC_SET_SIZE, &size));
+    RETURN_ON_ERROR(test_read(fd, rbuf + DEVICE_BUF_SIZE * 2, DEVICE_BUF_SIZE));
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, sizeof wbuf));
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+int test_channels(void)
+{
+    char wbuf[TEST_SIZE];
+    char rbuf[TEST_SIZE] = {0};
+    unsigned int channel = 1;
+    int fd, fd_a[2], fd_b;
+
+    printf("\nChannels test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_shared());
+    // Both files of the first channel share its queue
+    RETURN_ON_ERROR(fd_a[0] = ioctl(fd, LITECHR_IOC_OPEN_CHANNEL, &channel));
+    RETURN_ON_ERROR(fd_a[1] = ioctl(fd, LITECHR_IOC_OPEN_CHANNEL, &channel));
+    channel = 2;
+    RETURN_ON_ERROR(fd_b = ioctl(fd, LITECHR_IOC_OPEN_CHANNEL, &channel));
+    RETURN_ON_ERROR(test_write(fd_a[0], wbuf, TEST_SIZE));
+    // Neither the other channel nor the shared context see the data (a non-blocking read of an empty queue returns 0)
+    RETURN_ON_ERROR(set_nonblocking(fd_b));
+    RETURN_ON_ERROR(set_nonblocking(fd));
+    if (read(fd_b, rbuf, TEST_SIZE) != 0 || read(fd, rbuf, TEST_SIZE) != 0) {
+        printf("Error: data of the channel is visible outside of it\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(test_read(fd_a[1], rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+
+    close(fd_b);
+    close(fd_a[1]);
+    close(fd_a[0]);
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
+// Read the bytes of data pages charged to the storage budget from the driver statistics in debugfs
+int read_storage_used(size_t *pused)
+{
+    char line[128];
+    FILE *pfile;
+    int ret = -1;
+
+    pfile = fopen(STATS_FILE_NAME, "r");
+    if (pfile == NULL) {
+        printf("Opening %s: errno=%d\n", STATS_FILE_NAME, errno);
+        return -1;
+    }
+    while (fgets(line, sizeof line, pfile))
+        if (sscanf(line, "storage: %zu/", pused) == 1)
+            ret = 0;
+    fclose(pfile);
+    if (ret < 0)
+        printf("Error: no storage line in %s\n", STATS_FILE_NAME);
+    return ret;
+}
+
+int test_idle_storage(void)
+{
+    char wbuf[TEST_SIZE];
+    char rbuf[TEST_SIZE] = {0};
+    struct litechr_ring_header *phdr;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t used, idle_used;
+    int fd;
+
+    printf("\nIdle storage test\n\n");
+
+    fill_test_buf(wbuf, sizeof wbuf, 0);
+
+    RETURN_ON_ERROR(fd = open_multi());
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    RETURN_ON_ERROR(test_read(fd, rbuf, TEST_SIZE));
+    RETURN_ON_ERROR(read_storage_used(&used));
+    // The data pages of the empty context are freed meanwhile
+    usleep(IDLE_STORAGE_DELAY_US);
+    RETURN_ON_ERROR(read_storage_used(&idle_used));
+    if (idle_used >= used) {
+        printf("Error: data pages not freed (%zu bytes charged before, %zu after)\n", used, idle_used);
+        return -1;
+    }
+
+    // Indexes written through a mapping of the header alone do not make the context without data pages readable
+    phdr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (phdr == MAP_FAILED) {
+        printf("mmap: errno=%d\n", errno);
+        return -1;
+    }
+    phdr->head = phdr->tail + 100;
+    RETURN_ON_ERROR(set_nonblocking(fd));
+    if (test_read(fd, rbuf, TEST_SIZE) != 0) {
+        printf("Error: context without data pages is readable\n");
+        return -1;
+    }
+    munmap(phdr, page_size);
+
+    // The next write allocates the pages again (dropping the bogus indexes)
+    RETURN_ON_ERROR(test_write(fd, wbuf, TEST_SIZE));
+    // Stored data keeps the pages however long it waits
+    usleep(IDLE_STORAGE_DELAY_US);
+    memset(rbuf, 0, sizeof rbuf);
+    if (test_read(fd, rbuf, TEST_SIZE) != TEST_SIZE) {
+        printf("Error: stored data lost\n");
+        return -1;
+    }
+    RETURN_ON_ERROR(compare_buffers(wbuf, rbuf, TEST_SIZE));
+
+    close(fd);
+
+    printf("\nTest passed\n");
+
+    return 0;
+}
+
 int main(void)
 {
     clear_device_buffer();
@@ -551,10 +1364,37 @@ int main(void)
     RETURN_ON_ERROR(test_exclusive());
     // Test using device with multiple threads (writes then reads)
     RETURN_ON_ERROR(test_shared_threads());
-    // Test writing and reading of a large file using shared mode (driver should be compiled with MAX_BUFFER_SIZE = 20000 for litechrdrv.ko)
-    //RETURN_ON_ERROR(test_large_shared());
+    // Test blocking read/write and poll
+    RETURN_ON_ERROR(test_blocking());
+    // Test partial write mode
+    RETURN_ON_ERROR(test_partial_write());
+    // Test record mode
+    RETURN_ON_ERROR(test_records());
+    // Test vectored read/write
+    RETURN_ON_ERROR(test_vectored());
+    // Test splice to and from the device
+    RETURN_ON_ERROR(test_splice());
+    // Test FIONREAD and peek
+    RETURN_ON_ERROR(test_peek());
+    // Test reserve and commit
+    RETURN_ON_ERROR(test_reserve());
+    // Test broadcast mode
+    RETURN_ON_ERROR(test_broadcast());
+    // Test numbered channels
+    RETURN_ON_ERROR(test_channels());
+    // Test latency histogram reset
+    RETURN_ON_ERROR(test_latency());
+    // Test memory mapped ring
+    RETURN_ON_ERROR(test_mmap());
+    // Test reuse of released multi mode contexts
+    RETURN_ON_ERROR(test_multi_reuse());
+    // Test freeing the storage of idle multi mode contexts
+    RETURN_ON_ERROR(test_idle_storage());
+    // Test queue resizing
+    RETURN_ON_ERROR(test_resize());
+    // Test writing and reading of a large file using shared mode (the queue is resized to the file size)
+    RETURN_ON_ERROR(test_large_shared());
     // Test using device with multiple threads (simultaneous write and read of a large file)
-    // Can fail due to device buffer overflow    
     RETURN_ON_ERROR(test_large_shared_threads());
     
     printf("\nAll tests passed\n\n");
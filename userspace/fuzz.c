@@ -0,0 +1,274 @@
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/smp.h>
+#include <linux/atomic.h>
+#include <linux/xarray.h>
+#include <linux/list.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+
+#include "../context.h"
+
+// libFuzzer harness of the file context queue
+// The input is a queue size followed by a list of operations, which are applied both to a file context
+// and to a plain byte array model of it, every result and the queue contents are checked against the model.
+
+// Largest queue size and write length used by the harness
+#define FUZZ_MAX_SIZE       (64 * 1024)
+// Largest number of records the model keeps (every record takes a header in the queue)
+#define FUZZ_MAX_RECORDS    (FUZZ_MAX_SIZE / LITECHR_RECORD_HEADER_SIZE)
+
+enum fuzz_op {
+    FUZZ_WRITE_ITER,
+    FUZZ_READ_ITER,
+    FUZZ_WRITE_BUFFER,
+    FUZZ_READ_BUFFER,
+    FUZZ_CLEAR,
+    FUZZ_RECORDS,
+    FUZZ_RESIZE,
+    FUZZ_PEEK,
+    FUZZ_LEASE,
+    FUZZ_RECLAIM,
+    FUZZ_OPS,
+};
+
+// Expected queue contents (record data without headers in record mode)
+struct fuzz_model {
+    char data[FUZZ_MAX_SIZE];
+    size_t size;
+    u32 records[FUZZ_MAX_RECORDS];
+    size_t records_count;
+};
+
+// Input cursor
+struct fuzz_input {
+    const u8 *pdata;
+    size_t size;
+};
+
+static struct fuzz_model model;
+static char buf[FUZZ_MAX_SIZE];
+
+#define FUZZ_CHECK(cond) do { if (!(cond)) { fprintf(stderr, "Check failed: %s (line %d)\n", #cond, __LINE__); abort(); } } while (0)
+
+static unsigned int fuzz_take(struct fuzz_input *pinput, size_t bytes)
+{
+    unsigned int value = 0;
+
+    while (bytes-- && pinput->size) {
+        value = value << 8 | *pinput->pdata++;
+        pinput->size--;
+    }
+    return value;
+}
+
+// Bytes the queue holds in the model (including record headers)
+static size_t model_stored(void)
+{
+    return model.size + model.records_count * LITECHR_RECORD_HEADER_SIZE;
+}
+
+static void model_push(const char *pdata, size_t length, bool record)
+{
+    memcpy(model.data + model.size, pdata, length);
+    model.size += length;
+    if (record)
+        model.records[model.records_count++] = length;
+}
+
+// Remove bytes (a record in record mode) from the model, checking they match the ones read
+static void model_pop(const char *pdata, size_t length, bool record)
+{
+    size_t removed = record ? model.records[0] : length;
+
+    FUZZ_CHECK(memcmp(model.data, pdata, length) == 0);
+    memmove(model.data, model.data + removed, model.size - removed);
+    model.size -= removed;
+    if (record)
+        memmove(model.records, model.records + 1, --model.records_count * sizeof(model.records[0]));
+}
+
+static void fuzz_write(struct file_context *pfile_ctx, struct fuzz_input *pinput, bool iter)
+{
+    bool record = pfile_ctx->flags & LITECHR_CTX_RECORDS;
+    size_t length = fuzz_take(pinput, 2) % FUZZ_MAX_SIZE;
+    size_t space = pfile_ctx->data_queue.limit - model_stored();
+    struct iov_iter iter_from;
+    ssize_t ret;
+
+    length = min(length, pinput->size);
+    if (iter) {
+        kshim_iov_iter_init(&iter_from, (void *)pinput->pdata, length);
+        ret = file_context_data_queue_write_from_iter(pfile_ctx, &pfile_ctx->data_queue, &iter_from, false);
+    }
+    else {
+        // Buffer writes do not support records
+        if (record)
+            return;
+        ret = file_context_data_queue_write_from_buffer(pfile_ctx, (const char *)pinput->pdata, length);
+    }
+    if (record) {
+        // A record is stored as a whole or not at all
+        FUZZ_CHECK(ret == (length + LITECHR_RECORD_HEADER_SIZE > space ? 0 : (ssize_t)length));
+        if (length + LITECHR_RECORD_HEADER_SIZE <= space)
+            model_push((const char *)pinput->pdata, ret, record);
+    }
+    else {
+        FUZZ_CHECK(ret == (ssize_t)min(length, space));
+        model_push((const char *)pinput->pdata, ret, record);
+    }
+    pinput->pdata += length;
+    pinput->size -= length;
+}
+
+static void fuzz_read(struct file_context *pfile_ctx, struct fuzz_input *pinput, bool iter)
+{
+    bool record = pfile_ctx->flags & LITECHR_CTX_RECORDS;
+    size_t length = fuzz_take(pinput, 2) % FUZZ_MAX_SIZE;
+    size_t expected = record ? (model.records_count ? min_t(size_t, length, model.records[0]) : 0) : min(length, model.size);
+    struct iov_iter iter_to;
+    ssize_t ret;
+
+    if (iter) {
+        kshim_iov_iter_init(&iter_to, buf, length);
+        ret = file_context_data_queue_read_to_iter(pfile_ctx, &iter_to);
+    }
+    else {
+        if (record)
+            return;
+        ret = file_context_data_queue_read_to_buffer(pfile_ctx, buf, length);
+    }
+    FUZZ_CHECK(ret == (ssize_t)expected);
+    // A record is removed even if none of its bytes were read
+    if (record ? model.records_count != 0 : ret > 0)
+        model_pop(buf, ret, record);
+}
+
+static void fuzz_peek(struct file_context *pfile_ctx, struct fuzz_input *pinput, bool lease)
+{
+    bool record = pfile_ctx->flags & LITECHR_CTX_RECORDS;
+    size_t length = fuzz_take(pinput, 2) % FUZZ_MAX_SIZE;
+    size_t commit = fuzz_take(pinput, 2);
+    size_t expected = record ? (model.records_count ? min_t(size_t, length, model.records[0]) : 0) : min(length, model.size);
+    unsigned int pos;
+    ssize_t ret;
+
+    if (!lease) {
+        ret = file_context_data_queue_peek(pfile_ctx, buf, length);
+        FUZZ_CHECK(ret == (ssize_t)expected);
+        FUZZ_CHECK(memcmp(buf, model.data, ret) == 0);
+        FUZZ_CHECK(file_context_read_size(pfile_ctx) == (record ? (model.records_count ? model.records[0] : 0) : model.size));
+        return;
+    }
+
+    ret = file_context_lease(pfile_ctx, &model, buf, length, &pos);
+    FUZZ_CHECK(ret == (ssize_t)expected);
+    FUZZ_CHECK(memcmp(buf, model.data, ret) == 0);
+    // Nothing is leased if there are no bytes to lease (an empty record included)
+    if (ret == 0) {
+        FUZZ_CHECK(file_context_lease_commit(pfile_ctx, &model, 0) == -EINVAL);
+        return;
+    }
+    FUZZ_CHECK(!file_context_readable(pfile_ctx));
+    // Commit a part of the leased bytes (any part commits the whole record in record mode) or release the lease
+    if (commit & 1)
+        FUZZ_CHECK(file_context_lease_release(pfile_ctx, &model));
+    else {
+        commit = record ? commit % 2 : (commit >> 1) % (ret + 1);
+        FUZZ_CHECK(file_context_lease_commit(pfile_ctx, &model, commit) == 0);
+        if (commit)
+            model_pop(buf, record ? ret : commit, record);
+    }
+    FUZZ_CHECK(file_context_readable(pfile_ctx) == (model_stored() != 0));
+}
+
+int LLVMFuzzerTestOneInput(const u8 *pdata, size_t size)
+{
+    struct fuzz_input input = {pdata, size};
+    struct file_context file_ctx;
+    size_t queue_size;
+    unsigned int flags, op;
+    int ret;
+
+    queue_size = fuzz_take(&input, 2) % FUZZ_MAX_SIZE + 1;
+    // Latency timestamps and lazily allocated data pages
+    flags = fuzz_take(&input, 1);
+    if (file_context_init(&file_ctx, queue_size, flags & 1, flags & 2 ? 1 : 0, NULL) < 0)
+        return 0;
+    model.size = 0;
+    model.records_count = 0;
+
+    while (input.size) {
+        op = fuzz_take(&input, 1) % FUZZ_OPS;
+        switch (op) {
+        case FUZZ_WRITE_ITER:
+        case FUZZ_WRITE_BUFFER:
+            fuzz_write(&file_ctx, &input, op == FUZZ_WRITE_ITER);
+            break;
+        case FUZZ_READ_ITER:
+        case FUZZ_READ_BUFFER:
+            fuzz_read(&file_ctx, &input, op == FUZZ_READ_ITER);
+            break;
+        case FUZZ_CLEAR:
+            file_context_data_queue_clear(&file_ctx);
+            model.size = 0;
+            model.records_count = 0;
+            break;
+        case FUZZ_RECORDS:
+            flags = file_ctx.flags ^ LITECHR_CTX_RECORDS;
+            ret = file_context_flags_set(&file_ctx, flags);
+            FUZZ_CHECK(ret == (model_stored() ? -EBUSY :
+                (flags & LITECHR_CTX_RECORDS) && file_ctx.data_queue.limit <= LITECHR_RECORD_HEADER_SIZE ? -EINVAL : 0));
+            break;
+        case FUZZ_RESIZE:
+            queue_size = fuzz_take(&input, 2) % FUZZ_MAX_SIZE + 1;
+            ret = file_context_data_queue_resize(&file_ctx, queue_size);
+            if (ret == 0)
+                FUZZ_CHECK(queue_size >= model_stored());
+            else
+                FUZZ_CHECK(queue_size < model_stored() || ret == -EINVAL);
+            break;
+        case FUZZ_PEEK:
+        case FUZZ_LEASE:
+            fuzz_peek(&file_ctx, &input, op == FUZZ_LEASE);
+            break;
+        case FUZZ_RECLAIM:
+            // Only the data pages of an empty lazily allocated queue are freed
+            FUZZ_CHECK(file_context_storage_reclaim(&file_ctx) == (file_ctx.storage.idle && model_stored() == 0));
+            FUZZ_CHECK((file_ctx.data_queue.buf == NULL) == (file_ctx.storage.idle && model_stored() == 0));
+            break;
+        }
+        FUZZ_CHECK(file_context_size(&file_ctx) == model_stored());
+    }
+
+    file_context_remove(NULL, NULL, &file_ctx);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// Run the inputs given as files without libFuzzer (for builds with compilers lacking it)
+int main(int argc, char *argv[])
+{
+    static u8 input[FUZZ_MAX_SIZE * 4];
+    size_t size;
+    FILE *pfile;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        pfile = fopen(argv[i], "rb");
+        if (pfile == NULL) {
+            fprintf(stderr, "Opening %s: error %d\n", argv[i], errno);
+            return 1;
+        }
+        size = fread(input, 1, sizeof input, pfile);
+        fclose(pfile);
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    return 0;
+}
+#endif
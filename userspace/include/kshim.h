@@ -0,0 +1,98 @@
+#pragma once
+
+// Userspace replacements of the kernel APIs used by context.c, so that the file context queue
+// can be built into a userspace library (see the userspace targets of the Makefile).
+// Every linux/ header of this directory includes this one and adds its own part of the API.
+// Only the behavior context.c relies on is provided: locks are pthread mutexes, per CPU counters
+// have a single copy updated atomically, wait queues are empty and tracepoints are never enabled.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#define KBUILD_MODNAME      "litechrdrv"
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+typedef __s32 s32;
+typedef __s64 s64;
+
+// Annotations
+#define __user
+#define __percpu
+#define __packed            __attribute__((packed))
+
+// Accesses and memory ordering
+#define READ_ONCE(x)                (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val)          (*(volatile __typeof__(x) *)&(x) = (val))
+#define smp_load_acquire(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, val)   __atomic_store_n(p, val, __ATOMIC_RELEASE)
+// Returns the old value like the kernel one
+#define cmpxchg(p, old, new) ({ \
+    __typeof__(*(p)) __old = (old); \
+    __atomic_compare_exchange_n(p, &__old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+    __old; \
+})
+
+// Helpers
+#define min(a, b)           ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b)           ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a > __b ? __a : __b; })
+#define min3(a, b, c)       min(min(a, b), c)
+#define min_t(type, a, b)   min((type)(a), (type)(b))
+#define max_t(type, a, b)   max((type)(a), (type)(b))
+#define swap(a, b)          do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define likely(x)           __builtin_expect(!!(x), 1)
+#define unlikely(x)         __builtin_expect(!!(x), 0)
+
+// Error pointers
+#define MAX_ERRNO           4095
+
+#ifdef __cplusplus
+// C++ does not convert void pointers implicitly, so the error converts to any pointer type instead
+extern "C++" {
+struct kshim_err_ptr {
+    long error;
+    template <typename T> operator T *() const { return (T *)error; }
+};
+
+static inline kshim_err_ptr ERR_PTR(long error)
+{
+    return kshim_err_ptr{error};
+}
+}
+#else
+static inline void *ERR_PTR(long error)
+{
+    return (void *)error;
+}
+#endif
+
+static inline long PTR_ERR(const void *ptr)
+{
+    return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+    return (unsigned long)ptr >= (unsigned long)-MAX_ERRNO;
+}
+
+// Logging (pr_fmt has to be defined by the includer like in the kernel)
+#define pr_info(fmt, ...)   do { if (0) printf(pr_fmt(fmt), ##__VA_ARGS__); } while (0)
+#define pr_err(fmt, ...)    fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+
+// Allocation flags (ignored)
+typedef unsigned int gfp_t;
+#define GFP_KERNEL          0x1u
+#define GFP_KERNEL_ACCOUNT  0x3u
+#define __GFP_ZERO          0x100u
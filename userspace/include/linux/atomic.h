@@ -0,0 +1,36 @@
+#pragma once
+
+#include "../kshim.h"
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+typedef struct {
+    s64 counter;
+} atomic64_t;
+
+static inline int atomic_read(const atomic_t *pv)
+{
+    return __atomic_load_n(&pv->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_set(atomic_t *pv, int i)
+{
+    __atomic_store_n(&pv->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_read(const atomic64_t *pv)
+{
+    return __atomic_load_n(&pv->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_set(atomic64_t *pv, s64 i)
+{
+    __atomic_store_n(&pv->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_fetch_inc(atomic64_t *pv)
+{
+    return __atomic_fetch_add(&pv->counter, 1, __ATOMIC_SEQ_CST);
+}
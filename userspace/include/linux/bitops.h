@@ -0,0 +1,8 @@
+#pragma once
+
+#include "../kshim.h"
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Number of configured CPUs
+extern unsigned int nr_cpu_ids;
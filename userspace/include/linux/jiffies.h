@@ -0,0 +1,9 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Delays are only stored, so a jiffy is a millisecond
+static inline unsigned long msecs_to_jiffies(unsigned int msecs)
+{
+    return msecs;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <time.h>
+
+#include "../kshim.h"
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
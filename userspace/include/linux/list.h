@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../kshim.h"
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *plist)
+{
+    plist->next = plist;
+    plist->prev = plist;
+}
+
+static inline void list_add_tail(struct list_head *pnew, struct list_head *phead)
+{
+    pnew->prev = phead->prev;
+    pnew->next = phead;
+    phead->prev->next = pnew;
+    phead->prev = pnew;
+}
+
+static inline void list_del(struct list_head *pentry)
+{
+    pentry->prev->next = pentry->next;
+    pentry->next->prev = pentry->prev;
+}
+
+static inline void list_del_init(struct list_head *pentry)
+{
+    list_del(pentry);
+    INIT_LIST_HEAD(pentry);
+}
+
+static inline int list_empty(const struct list_head *phead)
+{
+    return READ_ONCE(phead->next) == phead;
+}
+
+#define list_entry(ptr, type, member)   container_of(ptr, type, member)
+
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+         n = list_entry(pos->member.next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "../kshim.h"
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1ul << (sizeof(unsigned long) * 8 - __builtin_clzl(n - 1));
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Pages are separate anonymous mappings of the system page size
+extern unsigned long kshim_page_size;
+extern unsigned int kshim_page_shift;
+#define PAGE_SIZE           kshim_page_size
+#define PAGE_SHIFT          kshim_page_shift
+
+struct page;
+
+struct page *alloc_page(gfp_t flags);
+void __free_page(struct page *ppage);
+void *page_address(const struct page *ppage);
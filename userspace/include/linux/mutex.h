@@ -0,0 +1,37 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "../kshim.h"
+
+struct mutex {
+    pthread_mutex_t lock;
+};
+
+static inline void mutex_init(struct mutex *pmtx)
+{
+    pthread_mutex_init(&pmtx->lock, NULL);
+}
+
+static inline void mutex_lock(struct mutex *pmtx)
+{
+    pthread_mutex_lock(&pmtx->lock);
+}
+
+// Userspace waits are never interrupted
+static inline int mutex_lock_interruptible(struct mutex *pmtx)
+{
+    pthread_mutex_lock(&pmtx->lock);
+    return 0;
+}
+
+// Returns 1 if the mutex was taken
+static inline int mutex_trylock(struct mutex *pmtx)
+{
+    return pthread_mutex_trylock(&pmtx->lock) == 0;
+}
+
+static inline void mutex_unlock(struct mutex *pmtx)
+{
+    pthread_mutex_unlock(&pmtx->lock);
+}
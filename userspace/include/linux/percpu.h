@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Per CPU variables have a single copy updated with atomic operations
+#define alloc_percpu(type)          ((type *)calloc(1, sizeof(type)))
+#define alloc_percpu_gfp(type, gfp) alloc_percpu(type)
+#define free_percpu(ptr)            free(ptr)
+#define per_cpu_ptr(ptr, cpu)       ((void)(cpu), (ptr))
+#define for_each_possible_cpu(cpu)  for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(pcp, val)      ((void)__atomic_fetch_add(&(pcp), val, __ATOMIC_RELAXED))
+#define this_cpu_inc(pcp)           this_cpu_add(pcp, 1)
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Per CPU counter kept as a single atomic sum, so the batches never apply
+struct percpu_counter {
+    s64 count;
+};
+
+static inline int percpu_counter_init(struct percpu_counter *pfbc, s64 amount, gfp_t flags)
+{
+    pfbc->count = amount;
+    return 0;
+}
+
+static inline void percpu_counter_destroy(struct percpu_counter *pfbc)
+{
+}
+
+static inline void percpu_counter_add_batch(struct percpu_counter *pfbc, s64 amount, s32 batch)
+{
+    __atomic_fetch_add(&pfbc->count, amount, __ATOMIC_RELAXED);
+}
+
+static inline int __percpu_counter_compare(struct percpu_counter *pfbc, s64 rhs, s32 batch)
+{
+    s64 count = __atomic_load_n(&pfbc->count, __ATOMIC_RELAXED);
+
+    return count > rhs ? 1 : count < rhs ? -1 : 0;
+}
+
+static inline s64 percpu_counter_sum_positive(struct percpu_counter *pfbc)
+{
+    s64 count = __atomic_load_n(&pfbc->count, __ATOMIC_RELAXED);
+
+    return count > 0 ? count : 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Threads may migrate anyway, which only affects the choice of a per CPU sub-queue
+static inline void preempt_disable(void)
+{
+}
+
+static inline void preempt_enable(void)
+{
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "../kshim.h"
+
+// There is no memory pressure notification in user space, so shrinkers are never called
+
+struct shrink_control {
+    unsigned long nr_to_scan;
+};
+
+struct shrinker {
+    unsigned long (*count_objects)(struct shrinker *pshrinker, struct shrink_control *psc);
+    unsigned long (*scan_objects)(struct shrinker *pshrinker, struct shrink_control *psc);
+    int seeks;
+};
+
+#define DEFAULT_SEEKS       2
+#define SHRINK_STOP         (~0UL)
+#define SHRINK_EMPTY        (~0UL - 1)
+
+static inline int register_shrinker(struct shrinker *pshrinker, const char *fmt, ...)
+{
+    return 0;
+}
+
+static inline void unregister_shrinker(struct shrinker *pshrinker)
+{
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "../kshim.h"
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+    return (flags & __GFP_ZERO) ? calloc(1, size) : malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+    return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+    return calloc(n, size);
+}
+
+static inline void kfree(const void *ptr)
+{
+    free((void *)ptr);
+}
+
+// Object cache (plain allocations of the object size)
+struct kmem_cache;
+
+// Cache flags (ignored)
+#define SLAB_ACCOUNT        0x04000000ul
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align, unsigned long flags,
+    void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *pcache);
+void *kmem_cache_zalloc(struct kmem_cache *pcache, gfp_t flags);
+void kmem_cache_free(struct kmem_cache *pcache, void *ptr);
+
+#define KMEM_CACHE(name, flags) kmem_cache_create(#name, sizeof(struct name), __alignof__(struct name), flags, NULL)
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "cpumask.h"
+
+// CPU the calling thread runs on (below nr_cpu_ids)
+int raw_smp_processor_id(void);
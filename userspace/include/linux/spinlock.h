@@ -0,0 +1,20 @@
+#pragma once
+
+#include "mutex.h"
+
+typedef struct mutex spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *plock)
+{
+    mutex_init(plock);
+}
+
+static inline void spin_lock(spinlock_t *plock)
+{
+    mutex_lock(plock);
+}
+
+static inline void spin_unlock(spinlock_t *plock)
+{
+    mutex_unlock(plock);
+}
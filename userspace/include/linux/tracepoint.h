@@ -0,0 +1,15 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Tracepoints are never enabled
+#define TP_PROTO(...)       __VA_ARGS__
+#define TP_ARGS(...)        __VA_ARGS__
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+    static inline void trace_##name(proto) {} \
+    static inline bool trace_##name##_enabled(void) { return false; }
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) {} \
+    static inline bool trace_##name##_enabled(void) { return false; }
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Iterator over a single flat buffer
+struct iov_iter {
+    char *buf;
+    size_t count;
+};
+
+static inline void kshim_iov_iter_init(struct iov_iter *piter, void *buf, size_t count)
+{
+    piter->buf = (char *)buf;
+    piter->count = count;
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *piter)
+{
+    return piter->count;
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *piter)
+{
+    bytes = min(bytes, piter->count);
+    memcpy(piter->buf, addr, bytes);
+    piter->buf += bytes;
+    piter->count -= bytes;
+    return bytes;
+}
+
+static inline size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *piter)
+{
+    bytes = min(bytes, piter->count);
+    memcpy(addr, piter->buf, bytes);
+    piter->buf += bytes;
+    piter->count -= bytes;
+    return bytes;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "mm.h"
+
+#define VM_MAP              0x4ul
+#define PAGE_KERNEL         0
+
+// Map the pages to a contiguous address range (the pages are moved into it, so their addresses change)
+void *vmap(struct page **pages, unsigned int count, unsigned long flags, int prot);
+// The range is unmapped as the pages moved into it are freed
+static inline void vunmap(const void *addr)
+{
+}
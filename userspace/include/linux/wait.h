@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Nobody sleeps in the library, so wait queues are empty
+typedef struct {
+    int unused;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *pwq)
+{
+}
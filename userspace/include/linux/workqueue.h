@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../kshim.h"
+
+// Work items are never run, the work they would do has to be triggered directly
+// (file_context_storage_reclaim instead of the idle check of the data pages)
+
+struct work_struct {
+    void (*func)(struct work_struct *pwork);
+};
+
+struct delayed_work {
+    struct work_struct work;
+};
+
+struct workqueue_struct;
+
+#define system_wq                   ((struct workqueue_struct *)NULL)
+
+#define INIT_DELAYED_WORK(pdwork, f)    ((pdwork)->work.func = (f))
+
+static inline struct delayed_work *to_delayed_work(struct work_struct *pwork)
+{
+    return container_of(pwork, struct delayed_work, work);
+}
+
+static inline bool queue_delayed_work(struct workqueue_struct *pwq, struct delayed_work *pdwork, unsigned long delay)
+{
+    return true;
+}
+
+static inline bool cancel_delayed_work_sync(struct delayed_work *pdwork)
+{
+    return false;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "../kshim.h"
+
+// Index allocating array of pointers (a growing table protected by a mutex)
+struct xarray {
+    pthread_mutex_t lock;
+    void **entries;
+    unsigned long size;
+};
+
+struct xa_limit {
+    u32 max;
+    u32 min;
+};
+
+#define XA_LIMIT(_min, _max)        ((struct xa_limit){ .max = (_max), .min = (_min) })
+#define DEFINE_XARRAY_ALLOC(name)   struct xarray name = { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void xa_init(struct xarray *pxa);
+void xa_destroy(struct xarray *pxa);
+void *xa_load(struct xarray *pxa, unsigned long index);
+// Store the entry at a free index within the limit
+// Returns 0 or -EBUSY if there is no free index
+int xa_alloc(struct xarray *pxa, u32 *pid, void *entry, struct xa_limit limit, gfp_t flags);
+void *xa_erase(struct xarray *pxa, unsigned long index);
@@ -0,0 +1,3 @@
+#pragma once
+
+// Nothing to define, tracepoints are empty inline functions
@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include <linux/smp.h>
+
+// Implementation of the kernel API replacements which are not inline (see include/kshim.h)
+
+unsigned long kshim_page_size;
+unsigned int kshim_page_shift;
+unsigned int nr_cpu_ids;
+
+struct kmem_cache {
+    size_t size;
+};
+
+// Page of memory (the address changes when the page is moved by vmap)
+struct page {
+    void *addr;
+};
+
+__attribute__((constructor))
+static void kshim_init(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    kshim_page_size = sysconf(_SC_PAGESIZE);
+    kshim_page_shift = __builtin_ctzl(kshim_page_size);
+    nr_cpu_ids = cpus > 0 ? cpus : 1;
+}
+
+int raw_smp_processor_id(void)
+{
+    int cpu = sched_getcpu();
+
+    return cpu < 0 ? 0 : (unsigned int)cpu % nr_cpu_ids;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align, unsigned long flags,
+    void (*ctor)(void *))
+{
+    struct kmem_cache *pcache = malloc(sizeof(*pcache));
+
+    if (pcache)
+        pcache->size = size;
+    return pcache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *pcache)
+{
+    free(pcache);
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *pcache, gfp_t flags)
+{
+    return calloc(1, pcache->size);
+}
+
+void kmem_cache_free(struct kmem_cache *pcache, void *ptr)
+{
+    free(ptr);
+}
+
+struct page *alloc_page(gfp_t flags)
+{
+    struct page *ppage = malloc(sizeof(*ppage));
+
+    if (ppage == NULL)
+        return NULL;
+    // Anonymous mappings are zeroed already
+    ppage->addr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ppage->addr == MAP_FAILED) {
+        free(ppage);
+        return NULL;
+    }
+    return ppage;
+}
+
+void __free_page(struct page *ppage)
+{
+    munmap(ppage->addr, PAGE_SIZE);
+    free(ppage);
+}
+
+void *page_address(const struct page *ppage)
+{
+    return ppage->addr;
+}
+
+void *vmap(struct page **pages, unsigned int count, unsigned long flags, int prot)
+{
+    char *addr;
+    void *moved;
+    unsigned int i;
+
+    // Reserve the range and move every page into its place, so the pages stay separately freeable
+    addr = mmap(NULL, (size_t)count * PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        moved = mremap(pages[i]->addr, PAGE_SIZE, PAGE_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, addr + i * PAGE_SIZE);
+        if (moved == MAP_FAILED) {
+            // The pages moved already are unmapped when they are freed
+            munmap(addr + i * PAGE_SIZE, (size_t)(count - i) * PAGE_SIZE);
+            return NULL;
+        }
+        pages[i]->addr = moved;
+    }
+    return addr;
+}
+
+void xa_init(struct xarray *pxa)
+{
+    pthread_mutex_init(&pxa->lock, NULL);
+    pxa->entries = NULL;
+    pxa->size = 0;
+}
+
+void xa_destroy(struct xarray *pxa)
+{
+    free(pxa->entries);
+    pxa->entries = NULL;
+    pxa->size = 0;
+}
+
+void *xa_load(struct xarray *pxa, unsigned long index)
+{
+    void *entry = NULL;
+
+    pthread_mutex_lock(&pxa->lock);
+    if (index < pxa->size)
+        entry = pxa->entries[index];
+    pthread_mutex_unlock(&pxa->lock);
+    return entry;
+}
+
+int xa_alloc(struct xarray *pxa, u32 *pid, void *entry, struct xa_limit limit, gfp_t flags)
+{
+    unsigned long index, size;
+    void **entries;
+    int ret = -EBUSY;
+
+    pthread_mutex_lock(&pxa->lock);
+    for (index = limit.min; index <= limit.max; index++) {
+        if (index >= pxa->size) {
+            // Grow the table to fit the index
+            size = max(index + 1, pxa->size * 2);
+            entries = realloc(pxa->entries, size * sizeof(*entries));
+            if (entries == NULL) {
+                ret = -ENOMEM;
+                break;
+            }
+            memset(entries + pxa->size, 0, (size - pxa->size) * sizeof(*entries));
+            pxa->entries = entries;
+            pxa->size = size;
+        }
+        if (pxa->entries[index] == NULL) {
+            pxa->entries[index] = entry;
+            *pid = index;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pxa->lock);
+    return ret;
+}
+
+void *xa_erase(struct xarray *pxa, unsigned long index)
+{
+    void *entry = NULL;
+
+    pthread_mutex_lock(&pxa->lock);
+    if (index < pxa->size) {
+        entry = pxa->entries[index];
+        pxa->entries[index] = NULL;
+    }
+    pthread_mutex_unlock(&pxa->lock);
+    return entry;
+}
@@ -0,0 +1,163 @@
+#include <chrono>
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/smp.h>
+#include <linux/atomic.h>
+#include <linux/xarray.h>
+#include <linux/list.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+
+#include "../context.h"
+}
+
+// Microbenchmarks of the file context queue built in user space, so that the cost of the queue itself
+// can be measured (and profiled with perf or valgrind) without the syscall and VFS overhead
+
+// Queue size of the benchmarked contexts
+#define BENCH_QUEUE_SIZE    (64 * 1024)
+
+static char buf[BENCH_QUEUE_SIZE];
+
+// Write and read back the same number of bytes, so the queue stays empty between iterations
+static void BM_WriteReadBuffer(benchmark::State &state)
+{
+    struct file_context file_ctx;
+    size_t length = state.range(0);
+
+    if (file_context_init(&file_ctx, BENCH_QUEUE_SIZE, false, 0, NULL) < 0) {
+        state.SkipWithError("file_context_init failed");
+        return;
+    }
+    for (auto _ : state) {
+        file_context_data_queue_write_from_buffer(&file_ctx, buf, length);
+        benchmark::DoNotOptimize(file_context_data_queue_read_to_buffer(&file_ctx, buf, length));
+    }
+    state.SetBytesProcessed(state.iterations() * length);
+    file_context_remove(NULL, NULL, &file_ctx);
+}
+BENCHMARK(BM_WriteReadBuffer)->RangeMultiplier(4)->Range(1, BENCH_QUEUE_SIZE);
+
+// Fill the queue with writes, emptying it whenever the next write does not fit
+static void BM_WriteBuffer(benchmark::State &state)
+{
+    struct file_context file_ctx;
+    size_t length = state.range(0);
+
+    if (file_context_init(&file_ctx, BENCH_QUEUE_SIZE, false, 0, NULL) < 0) {
+        state.SkipWithError("file_context_init failed");
+        return;
+    }
+    for (auto _ : state) {
+        if (file_context_data_queue_write_from_buffer(&file_ctx, buf, length) < length)
+            file_context_data_queue_clear(&file_ctx);
+    }
+    state.SetBytesProcessed(state.iterations() * length);
+    file_context_remove(NULL, NULL, &file_ctx);
+}
+BENCHMARK(BM_WriteBuffer)->RangeMultiplier(4)->Range(1, BENCH_QUEUE_SIZE);
+
+// Drain the queue with reads, filling it whenever it gets empty (the fill is not measured)
+static void BM_ReadBuffer(benchmark::State &state)
+{
+    struct file_context file_ctx;
+    size_t length = state.range(0);
+
+    if (file_context_init(&file_ctx, BENCH_QUEUE_SIZE, false, 0, NULL) < 0) {
+        state.SkipWithError("file_context_init failed");
+        return;
+    }
+    for (auto _ : state) {
+        if (file_context_size(&file_ctx) < length) {
+            state.PauseTiming();
+            while (file_context_data_queue_write_from_buffer(&file_ctx, buf, BENCH_QUEUE_SIZE))
+                ;
+            state.ResumeTiming();
+        }
+        benchmark::DoNotOptimize(file_context_data_queue_read_to_buffer(&file_ctx, buf, length));
+    }
+    state.SetBytesProcessed(state.iterations() * length);
+    file_context_remove(NULL, NULL, &file_ctx);
+}
+BENCHMARK(BM_ReadBuffer)->RangeMultiplier(16)->Range(1, BENCH_QUEUE_SIZE);
+
+// Empty a queue holding the given number of bytes, the cost must not depend on it
+// (only the clear is timed, the time includes reading the clock)
+static void BM_Clear(benchmark::State &state)
+{
+    struct file_context file_ctx;
+    size_t length = state.range(0);
+    std::chrono::steady_clock::time_point start;
+
+    if (file_context_init(&file_ctx, BENCH_QUEUE_SIZE, false, 0, NULL) < 0) {
+        state.SkipWithError("file_context_init failed");
+        return;
+    }
+    for (auto _ : state) {
+        file_context_data_queue_write_from_buffer(&file_ctx, buf, length);
+        start = std::chrono::steady_clock::now();
+        file_context_data_queue_clear(&file_ctx);
+        state.SetIterationTime(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    file_context_remove(NULL, NULL, &file_ctx);
+}
+BENCHMARK(BM_Clear)->RangeMultiplier(16)->Range(1, BENCH_QUEUE_SIZE)->UseManualTime();
+
+// Write and read back a record through I/O iterators like the driver does (latency timestamps optional)
+static void BM_WriteReadRecord(benchmark::State &state)
+{
+    struct file_context file_ctx;
+    struct iov_iter iter;
+    size_t length = state.range(0);
+
+    if (file_context_init(&file_ctx, BENCH_QUEUE_SIZE, state.range(1), 0, NULL) < 0 ||
+        file_context_flags_set(&file_ctx, LITECHR_CTX_RECORDS) < 0) {
+        state.SkipWithError("file_context_init failed");
+        return;
+    }
+    for (auto _ : state) {
+        kshim_iov_iter_init(&iter, buf, length);
+        file_context_data_queue_write_from_iter(&file_ctx, &file_ctx.data_queue, &iter, false);
+        kshim_iov_iter_init(&iter, buf, length);
+        benchmark::DoNotOptimize(file_context_data_queue_read_to_iter(&file_ctx, &iter));
+    }
+    state.SetBytesProcessed(state.iterations() * length);
+    file_context_remove(NULL, NULL, &file_ctx);
+}
+BENCHMARK(BM_WriteReadRecord)->ArgsProduct({{1, 64, 4096}, {false, true}});
+
+// One producer and one consumer thread moving bytes through the ring without locks, like an exclusive mode file does
+static struct file_context spsc_file_ctx;
+
+static void BM_SpscBuffer(benchmark::State &state)
+{
+    size_t length = state.range(0);
+    char thread_buf[BENCH_QUEUE_SIZE];
+    size_t moved = 0;
+
+    if (state.thread_index() == 0 && file_context_init(&spsc_file_ctx, BENCH_QUEUE_SIZE, false, 0, NULL) < 0)
+        abort();
+    for (auto _ : state) {
+        if (state.thread_index() == 0)
+            moved += file_context_data_queue_write_from_buffer(&spsc_file_ctx, thread_buf, length);
+        else
+            moved += file_context_data_queue_read_to_buffer(&spsc_file_ctx, thread_buf, length);
+    }
+    // Bytes are counted once, when they are read
+    if (state.thread_index() == 1)
+        state.SetBytesProcessed(moved);
+    if (state.thread_index() == 0)
+        file_context_remove(NULL, NULL, &spsc_file_ctx);
+}
+BENCHMARK(BM_SpscBuffer)->RangeMultiplier(16)->Range(1, 4096)->Threads(2)->UseRealTime();
+
+BENCHMARK_MAIN();